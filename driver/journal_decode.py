@@ -0,0 +1,63 @@
+__author__ = 'ejcosta'
+
+import sys
+import time
+import struct
+
+JOURNAL = '/sys/kernel/debug/tuxedo-wmi/journal'
+# struct tuxedo_journal_entry: time (ns), seq, arg, retval, result, method, source
+ENTRY = struct.Struct('<QIIIhBB')
+
+sources = ('init', 'sysfs', 'hotkey', 'resume', 'rfkill', 'calibrate', 'idle', 'exit')
+methods = {
+    0x01: 'GET_EVENT',
+    0x0A: 'GET_POWER_STATE_FOR_3G',
+    0x46: 'GET_AP',
+    0x4C: 'SET_3G',
+    0x67: 'SET_KB_LED',
+    0x6D: 'AIRPLANE_BUTTON',
+    0x78: 'TALK_BIOS_3G',
+}
+
+
+def read_entries(f, follow=False):
+    """ Yields (seconds, seq, method, arg, retval, result, source) of each journal entry in f,
+        following waits for new entries once driver journal is drained instead of stopping """
+    pending = b''
+    while True:
+        data = f.read(ENTRY.size * 512)
+        if not data:
+            if not follow:
+                return
+            time.sleep(0.5)
+            continue
+        data = pending + data
+        end = len(data) - len(data) % ENTRY.size
+        for offset in range(0, end, ENTRY.size):
+            ns, seq, arg, retval, result, method, source = ENTRY.unpack_from(data, offset)
+            yield (ns / 1e9, seq, methods.get(method, '{:#04x}'.format(method)), arg, retval, result,
+                   sources[source] if source < len(sources) else str(source))
+        pending = data[end:]
+
+
+def decode(f, follow=False, out=sys.stdout):
+    """ Prints one line per command, and how many were lost when reader fell behind the journal """
+    last = None
+    for seconds, seq, method, arg, retval, result, source in read_entries(f, follow):
+        if last is not None and seq != last + 1:
+            out.write("-- {} entries lost --\n".format(seq - last - 1))
+        last = seq
+        out.write("{:14.6f} {:8} {:9} {:22} {:#010x} -> {:#010x}{}\n".format(
+            seconds, seq, source, method, arg, retval, " (error {})".format(result) if result else ""))
+        out.flush()
+
+
+if __name__ == "__main__":
+    # journal_decode.py [file], stream live journal (until Ctrl+C) or decode a saved copy of it
+    path = sys.argv[1] if len(sys.argv) > 1 else JOURNAL
+    try:
+        # unbuffered, so every read reaches driver and drained journal shows up as an empty read
+        with open(path, 'rb', 0) as journal:
+            decode(journal, path == JOURNAL)
+    except KeyboardInterrupt:
+        pass
@@ -21,17 +21,20 @@
 #define pr_fmt(fmt) TUXEDO_DRIVER_NAME ": " fmt
 
 #include <linux/acpi.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/dmi.h>
 #include <linux/input.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
 #include <linux/leds.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/platform_device.h>
 #include <linux/rfkill.h>
 #include <linux/stringify.h>
+#include <linux/uaccess.h>
 #include <linux/version.h>
 #include <linux/workqueue.h>
 
@@ -163,6 +166,114 @@ module_param_named(poll_freq, param_poll_freq, poll_freq, S_IRUSR);
 MODULE_PARM_DESC(poll_freq, "Set polling frequency");
 
 
+/* EC access layer */
+
+#define EC_REG_AIRPLANE_LED   0xD9
+#define EC_REG_HOTKEY_STATUS  0xDB
+
+#define EC_AIRPLANE_LED       0x40
+#define EC_AIRPLANE_HOTKEY    0x40
+
+/*
+ * Bits only the driver changes are cached, so reading them back costs no EC
+ * transaction. Firmware changes the other bits of those registers on its own,
+ * so read-modify-write sequences always read the register again, under one
+ * lock so the polling thread and the LED path never interleave, and skip the
+ * write when the value would not change.
+ */
+static DEFINE_MUTEX(tuxedo_ec_mutex);
+static u8 tuxedo_ec_cache[256];
+static DECLARE_BITMAP(tuxedo_ec_cache_valid, 256);
+
+static u8 tuxedo_ec_owned_bits(u8 reg)
+{
+	return reg == EC_REG_AIRPLANE_LED ? EC_AIRPLANE_LED : 0;
+}
+
+/* call with tuxedo_ec_mutex held */
+static int __tuxedo_ec_read(u8 reg, u8 *val)
+{
+	int err;
+
+	err = ec_read(reg, val);
+	if (unlikely(err))
+		return err;
+
+	if (tuxedo_ec_owned_bits(reg)) {
+		tuxedo_ec_cache[reg] = *val & tuxedo_ec_owned_bits(reg);
+		set_bit(reg, tuxedo_ec_cache_valid);
+	}
+
+	return 0;
+}
+
+/* call with tuxedo_ec_mutex held */
+static int __tuxedo_ec_write(u8 reg, u8 val)
+{
+	int err;
+
+	err = ec_write(reg, val);
+
+	if (likely(!err) && tuxedo_ec_owned_bits(reg)) {
+		tuxedo_ec_cache[reg] = val & tuxedo_ec_owned_bits(reg);
+		set_bit(reg, tuxedo_ec_cache_valid);
+	} else {
+		clear_bit(reg, tuxedo_ec_cache_valid);
+	}
+
+	return err;
+}
+
+/* reads the bits in mask, from cache when the driver owns all of them */
+static int tuxedo_ec_read_bits(u8 reg, u8 mask, u8 *val)
+{
+	int err = 0;
+
+	mutex_lock(&tuxedo_ec_mutex);
+
+	if ((mask & ~tuxedo_ec_owned_bits(reg)) || !test_bit(reg, tuxedo_ec_cache_valid))
+		err = __tuxedo_ec_read(reg, val);
+	else
+		*val = tuxedo_ec_cache[reg];
+
+	mutex_unlock(&tuxedo_ec_mutex);
+
+	if (likely(!err))
+		*val &= mask;
+
+	return err;
+}
+
+/* sets the bits in mask to those in bits, the value found is stored in old (if not NULL) */
+static int tuxedo_ec_update_bits(u8 reg, u8 mask, u8 bits, u8 *old)
+{
+	int err;
+	u8 byte;
+
+	mutex_lock(&tuxedo_ec_mutex);
+
+	err = __tuxedo_ec_read(reg, &byte);
+	if (likely(!err)) {
+		if (old)
+			*old = byte;
+		if ((byte & mask) != (bits & mask))
+			err = __tuxedo_ec_write(reg, (byte & ~mask) | (bits & mask));
+	}
+
+	mutex_unlock(&tuxedo_ec_mutex);
+
+	return err;
+}
+
+/* EC may lose or change state while suspended */
+static void tuxedo_ec_invalidate(void)
+{
+	mutex_lock(&tuxedo_ec_mutex);
+	bitmap_zero(tuxedo_ec_cache_valid, 256);
+	mutex_unlock(&tuxedo_ec_mutex);
+}
+
+
 struct platform_device *tuxedo_platform_device;
 
 /* input sub-driver */
@@ -195,10 +306,9 @@ static int tuxedo_input_polling_thread(void *data)
 
 		u8 byte;
 
-		ec_read(0xDB, &byte);
-		if (byte & 0x40) {
-			ec_write(0xDB, byte & ~0x40);
-
+		/* hotkey bit is cleared in the same locked sequence it is read in */
+		if (!tuxedo_ec_update_bits(EC_REG_HOTKEY_STATUS, EC_AIRPLANE_HOTKEY, 0, &byte) &&
+		    (byte & EC_AIRPLANE_HOTKEY)) {
 			TUXEDO_DEBUG("Airplane-Mode Hotkey pressed\n");
 
 			mutex_lock(&tuxedo_input_report_mutex);
@@ -247,7 +357,6 @@ static void tuxedo_input_close(struct input_dev *dev)
 static int __init tuxedo_input_init(void)
 {
 	int err;
-	u8 byte;
 
 	tuxedo_input_device = input_allocate_device();
 	if (unlikely(!tuxedo_input_device)) {
@@ -266,8 +375,7 @@ static int __init tuxedo_input_init(void)
 	set_bit(EV_KEY, tuxedo_input_device->evbit);
 	set_bit(KEY_RFKILL, tuxedo_input_device->keybit);
 
-	ec_read(0xDB, &byte);
-	ec_write(0xDB, byte & ~0x40);
+	tuxedo_ec_update_bits(EC_REG_HOTKEY_STATUS, EC_AIRPLANE_HOTKEY, 0, NULL);
 
 	err = input_register_device(tuxedo_input_device);
 	if (unlikely(err)) {
@@ -293,13 +401,133 @@ static void __exit tuxedo_input_exit(void)
 }
 
 
-static int tuxedo_wmi_evaluate_wmbb_method(u32 method_id, u32 arg, u32 *retval)
+/* command journal */
+
+enum tuxedo_journal_source {
+	JOURNAL_SOURCE_INIT,
+	JOURNAL_SOURCE_SYSFS,
+	JOURNAL_SOURCE_HOTKEY,
+	JOURNAL_SOURCE_RESUME,
+	JOURNAL_SOURCE_RFKILL,
+	JOURNAL_SOURCE_CALIBRATE,
+	JOURNAL_SOURCE_IDLE,
+	JOURNAL_SOURCE_EXIT,
+};
+
+/* one WMBB call, as read from debugfs (see journal_decode.py) */
+struct tuxedo_journal_entry {
+	u64 time;    /* ns since boot */
+	u32 seq;     /* position in journal + 1, 0 while entry is being written */
+	u32 arg;
+	u32 retval;
+	s16 result;
+	u8  method;
+	u8  source;
+};
+
+#define JOURNAL_SIZE 512  /* entries, power of 2 */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#endif
+
+static struct tuxedo_journal_entry tuxedo_journal[JOURNAL_SIZE];
+static atomic_t tuxedo_journal_head = ATOMIC_INIT(0);
+
+/*
+ * Writers claim a slot with a single atomic increment and never wait, so
+ * recording costs a few stores whether anybody reads the journal or not.
+ * The sequence number is stored last and tells readers the entry is complete.
+ */
+static void tuxedo_journal_record(enum tuxedo_journal_source source, u32 method_id,
+                                  u32 arg, u32 retval, int result)
+{
+	u32 seq = (u32) atomic_inc_return(&tuxedo_journal_head);
+	struct tuxedo_journal_entry *entry = &tuxedo_journal[(seq - 1) & (JOURNAL_SIZE - 1)];
+
+	WRITE_ONCE(entry->seq, 0);
+	smp_wmb();
+
+	entry->time   = ktime_to_ns(ktime_get());
+	entry->arg    = arg;
+	entry->retval = retval;
+	entry->result = result;
+	entry->method = method_id;
+	entry->source = source;
+
+	smp_wmb();
+	WRITE_ONCE(entry->seq, seq);
+}
+
+/*
+ * Streams entries not read yet by this reader, oldest first. Entries
+ * overwritten before they were read are skipped, gaps in seq show how many.
+ */
+static ssize_t tuxedo_journal_read(struct file *file, char __user *buf,
+                                   size_t count, loff_t *ppos)
+{
+	struct tuxedo_journal_entry entry, *slot;
+	u32 head = (u32) atomic_read(&tuxedo_journal_head);
+	u32 pos = (u32) *ppos;
+	size_t copied = 0;
+	u32 seq;
+
+	if (count < sizeof(entry))
+		return -EINVAL;
+
+	if (head - pos > JOURNAL_SIZE)
+		pos = head - JOURNAL_SIZE;
+
+	while (pos != head && copied + sizeof(entry) <= count) {
+		slot = &tuxedo_journal[pos & (JOURNAL_SIZE - 1)];
+
+		seq = READ_ONCE(slot->seq);
+		smp_rmb();
+		entry = *slot;
+		smp_rmb();
+
+		/* still being written, next read picks it up */
+		if (seq == 0)
+			break;
+
+		/* overwritten before or while it was copied */
+		if (seq != pos + 1 || READ_ONCE(slot->seq) != seq) {
+			pos++;
+			continue;
+		}
+
+		if (copy_to_user(buf + copied, &entry, sizeof(entry)))
+			return -EFAULT;
+
+		copied += sizeof(entry);
+		pos++;
+	}
+
+	*ppos = pos;
+
+	return copied;
+}
+
+static const struct file_operations tuxedo_journal_fops = {
+	.owner  = THIS_MODULE,
+	.open   = nonseekable_open,
+	.read   = tuxedo_journal_read,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,12,0)
+	.llseek = no_llseek,
+#endif
+};
+
+
+/* source is the entry point that led to the call, it's only used by the journal */
+static int tuxedo_wmi_evaluate_wmbb_method(u32 method_id, u32 arg, u32 *retval,
+                                           enum tuxedo_journal_source source)
 {
 	struct acpi_buffer in  = { (acpi_size) sizeof(arg), &arg };
 	struct acpi_buffer out = { ACPI_ALLOCATE_BUFFER, NULL };
 	union acpi_object *obj;
 	acpi_status status;
-	u32 tmp;
+	u32 tmp = 0;
 
 	TUXEDO_DEBUG("%0#4x  IN : %0#6x\n", method_id, arg);
 
@@ -324,6 +552,8 @@ static int tuxedo_wmi_evaluate_wmbb_method(u32 method_id, u32 arg, u32 *retval)
 	kfree(obj);
 
 exit:
+	tuxedo_journal_record(source, method_id, arg, tmp, ACPI_FAILURE(status) ? -EIO : 0);
+
 	if (unlikely(ACPI_FAILURE(status)))
 		return -EIO;
 
@@ -358,17 +588,18 @@ static struct {
 	} mode;
 
 	struct kb_backlight_ops {
-		void (*set_state)(enum kb_state state);
-		void (*set_color)(unsigned left, unsigned center, unsigned right);
-		void (*set_brightness)(unsigned brightness);
-		void (*set_mode)(enum kb_mode);
-		void (*init)(void);
+		void (*set_state)(enum kb_state state, enum tuxedo_journal_source source);
+		void (*set_color)(unsigned left, unsigned center, unsigned right,
+		                  enum tuxedo_journal_source source);
+		void (*set_brightness)(unsigned brightness, enum tuxedo_journal_source source);
+		void (*set_mode)(enum kb_mode, enum tuxedo_journal_source source);
+		void (*init)(enum tuxedo_journal_source source);
 	} *ops;
 
 } kb_backlight = { .ops = NULL, };
 
 
-static void kb_dec_brightness(void)
+static void kb_dec_brightness(enum tuxedo_journal_source source)
 {
 	if (kb_backlight.state == KB_STATE_OFF || kb_backlight.mode != KB_MODE_CUSTOM)
 		return;
@@ -377,34 +608,34 @@ static void kb_dec_brightness(void)
 
 	TUXEDO_DEBUG();
 
-	kb_backlight.ops->set_brightness(kb_backlight.brightness - 1);
+	kb_backlight.ops->set_brightness(kb_backlight.brightness - 1, source);
 }
 
-static void kb_inc_brightness(void)
+static void kb_inc_brightness(enum tuxedo_journal_source source)
 {
 	if (kb_backlight.state == KB_STATE_OFF || kb_backlight.mode != KB_MODE_CUSTOM)
 		return;
 
 	TUXEDO_DEBUG();
 
-	kb_backlight.ops->set_brightness(kb_backlight.brightness + 1);
+	kb_backlight.ops->set_brightness(kb_backlight.brightness + 1, source);
 }
 
-static void kb_toggle_state(void)
+static void kb_toggle_state(enum tuxedo_journal_source source)
 {
 	switch (kb_backlight.state) {
 	case KB_STATE_OFF:
-		kb_backlight.ops->set_state(KB_STATE_ON);
+		kb_backlight.ops->set_state(KB_STATE_ON, source);
 		break;
 	case KB_STATE_ON:
-		kb_backlight.ops->set_state(KB_STATE_OFF);
+		kb_backlight.ops->set_state(KB_STATE_OFF, source);
 		break;
 	default:
 		BUG();
 	}
 }
 
-static void kb_next_mode(void)
+static void kb_next_mode(enum tuxedo_journal_source source)
 {
 	static enum kb_mode modes[] = {
 		KB_MODE_RANDOM_COLOR,
@@ -429,13 +660,14 @@ static void kb_next_mode(void)
 
 	BUG_ON(i == ARRAY_SIZE(modes));
 
-	kb_backlight.ops->set_mode(modes[(i + 1) % ARRAY_SIZE(modes)]);
+	kb_backlight.ops->set_mode(modes[(i + 1) % ARRAY_SIZE(modes)], source);
 }
 
 
 /* full color backlight keyboard */
 
-static void kb_full_color__set_color(unsigned left, unsigned center, unsigned right)
+static void kb_full_color__set_color(unsigned left, unsigned center, unsigned right,
+                                     enum tuxedo_journal_source source)
 {
 	u32 cmd;
 
@@ -446,7 +678,7 @@ static void kb_full_color__set_color(unsigned left, unsigned center, unsigned ri
 	cmd |= kb_colors[left].value.r <<  8;
 	cmd |= kb_colors[left].value.g <<  0;
 
-	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL))
+	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL, source))
 		kb_backlight.color.left = left;
 
 	cmd = 0xF1000000;
@@ -454,7 +686,7 @@ static void kb_full_color__set_color(unsigned left, unsigned center, unsigned ri
 	cmd |= kb_colors[center].value.r <<  8;
 	cmd |= kb_colors[center].value.g <<  0;
 
-	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL))
+	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL, source))
 		kb_backlight.color.center = center;
 
 	cmd = 0xF2000000;
@@ -462,13 +694,13 @@ static void kb_full_color__set_color(unsigned left, unsigned center, unsigned ri
 	cmd |= kb_colors[right].value.r <<  8;
 	cmd |= kb_colors[right].value.g <<  0;
 
-	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL))
+	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL, source))
 		kb_backlight.color.right = right;
 
 	kb_backlight.mode = KB_MODE_CUSTOM;
 }
 
-static void kb_full_color__set_brightness(unsigned i)
+static void kb_full_color__set_brightness(unsigned i, enum tuxedo_journal_source source)
 {
 
 	u32 cmd = 0xD2010000;
@@ -485,7 +717,7 @@ static void kb_full_color__set_brightness(unsigned i)
 	cmd |= kb_backlight.color.center << 4;
 	cmd |= kb_backlight.color.left;
 
-	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL))
+	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL, source))
 		kb_backlight.brightness = i;
 
 	/* kb_8_color__set_brightness seems to work better on P751ZM
@@ -495,12 +727,12 @@ static void kb_full_color__set_brightness(unsigned i)
 
 	i = clamp_t(unsigned, i, 0, ARRAY_SIZE(lvl_to_raw) - 1);
 
-	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, 0xF4000000 | lvl_to_raw[i], NULL))
+	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, 0xF4000000 | lvl_to_raw[i], NULL, source))
 		kb_backlight.brightness = i;
 	*/
 }
 
-static void kb_full_color__set_mode(unsigned mode)
+static void kb_full_color__set_mode(unsigned mode, enum tuxedo_journal_source source)
 {
 	static u32 cmds[] = {
 		[KB_MODE_BREATHE]      = 0x1002a000,
@@ -517,21 +749,21 @@ static void kb_full_color__set_mode(unsigned mode)
 
 	BUG_ON(mode >= ARRAY_SIZE(cmds));
 
-	tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, 0x10000000, NULL);
+	tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, 0x10000000, NULL, source);
 
 	if (mode == KB_MODE_CUSTOM) {
 		kb_full_color__set_color(kb_backlight.color.left,
 		                         kb_backlight.color.center,
-		                         kb_backlight.color.right);
-		kb_full_color__set_brightness(kb_backlight.brightness);
+		                         kb_backlight.color.right, source);
+		kb_full_color__set_brightness(kb_backlight.brightness, source);
 		return;
 	}
 
-	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmds[mode], NULL))
+	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmds[mode], NULL, source))
 		kb_backlight.mode = mode;
 }
 
-static void kb_full_color__set_state(enum kb_state state)
+static void kb_full_color__set_state(enum kb_state state, enum tuxedo_journal_source source)
 {
 	u32 cmd = 0xE0000000;
 
@@ -548,17 +780,17 @@ static void kb_full_color__set_state(enum kb_state state)
 		BUG();
 	}
 
-	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL))
+	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL, source))
 		kb_backlight.state = state;
 }
 
-static void kb_full_color__init(void)
+static void kb_full_color__init(enum tuxedo_journal_source source)
 {
 	TUXEDO_DEBUG();
 
-	kb_full_color__set_state(param_kb_off ? KB_STATE_OFF : KB_STATE_ON);
-	kb_full_color__set_color(param_kb_color[0], param_kb_color[1], param_kb_color[2]);
-	kb_full_color__set_brightness(param_kb_brightness);
+	kb_full_color__set_state(param_kb_off ? KB_STATE_OFF : KB_STATE_ON, source);
+	kb_full_color__set_color(param_kb_color[0], param_kb_color[1], param_kb_color[2], source);
+	kb_full_color__set_brightness(param_kb_brightness, source);
 }
 
 static struct kb_backlight_ops kb_full_color_ops = {
@@ -572,7 +804,8 @@ static struct kb_backlight_ops kb_full_color_ops = {
 
 /* 8 color backlight keyboard */
 
-static void kb_8_color__set_color(unsigned left, unsigned center, unsigned right)
+static void kb_8_color__set_color(unsigned left, unsigned center, unsigned right,
+                                  enum tuxedo_journal_source source)
 {
 	u32 cmd = 0x02010000;
 
@@ -581,7 +814,7 @@ static void kb_8_color__set_color(unsigned left, unsigned center, unsigned right
 	cmd |= center << 4;
 	cmd |= left;
 
-	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL)) {
+	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL, source)) {
 		kb_backlight.color.left   = left;
 		kb_backlight.color.center = center;
 		kb_backlight.color.right  = right;
@@ -590,7 +823,7 @@ static void kb_8_color__set_color(unsigned left, unsigned center, unsigned right
 	kb_backlight.mode = KB_MODE_CUSTOM;
 }
 
-static void kb_8_color__set_brightness(unsigned i)
+static void kb_8_color__set_brightness(unsigned i, enum tuxedo_journal_source source)
 {
 	u32 cmd = 0xD2010000;
 
@@ -605,11 +838,11 @@ static void kb_8_color__set_brightness(unsigned i)
 	cmd |= kb_backlight.color.center << 4;
 	cmd |= kb_backlight.color.left;
 
-	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL))
+	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmd, NULL, source))
 		kb_backlight.brightness = i;
 }
 
-static void kb_8_color__set_mode(unsigned mode)
+static void kb_8_color__set_mode(unsigned mode, enum tuxedo_journal_source source)
 {
 	static u32 cmds[] = {
 		[KB_MODE_BREATHE]      = 0x12010000,
@@ -626,31 +859,31 @@ static void kb_8_color__set_mode(unsigned mode)
 
 	BUG_ON(mode >= ARRAY_SIZE(cmds));
 
-	tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, 0x20000000, NULL);
+	tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, 0x20000000, NULL, source);
 
 	if (mode == KB_MODE_CUSTOM){
 		kb_8_color__set_color(kb_backlight.color.left,
 		                      kb_backlight.color.center,
-		                      kb_backlight.color.right);
-		kb_8_color__set_brightness(kb_backlight.brightness);
+		                      kb_backlight.color.right, source);
+		kb_8_color__set_brightness(kb_backlight.brightness, source);
 		return;
 	}
 
-	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmds[mode], NULL))
+	if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, cmds[mode], NULL, source))
 		kb_backlight.mode = mode;
 }
 
-static void kb_8_color__set_state(enum kb_state state)
+static void kb_8_color__set_state(enum kb_state state, enum tuxedo_journal_source source)
 {
 	TUXEDO_DEBUG("State: %d\n", state);
 
 	switch (state) {
 	case KB_STATE_OFF:
-		if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, 0x22010000, NULL))
+		if (!tuxedo_wmi_evaluate_wmbb_method(SET_KB_LED, 0x22010000, NULL, source))
 			kb_backlight.state = state;
 		break;
 	case KB_STATE_ON:
-		kb_8_color__set_mode(kb_backlight.mode);
+		kb_8_color__set_mode(kb_backlight.mode, source);
 		kb_backlight.state = state;
 		break;
 	default:
@@ -658,13 +891,13 @@ static void kb_8_color__set_state(enum kb_state state)
 	}
 }
 
-static void kb_8_color__init(void)
+static void kb_8_color__init(enum tuxedo_journal_source source)
 {
 	TUXEDO_DEBUG();
 
 	/* well, that's an uglymoron ... */
 
-	kb_8_color__set_state(KB_STATE_OFF);
+	kb_8_color__set_state(KB_STATE_OFF, source);
 
 	kb_backlight.color.left   = param_kb_color[0];
 	kb_backlight.color.center = param_kb_color[1];
@@ -676,9 +909,9 @@ static void kb_8_color__init(void)
 	if (!param_kb_off) {
 		kb_8_color__set_color(kb_backlight.color.left,
 		                      kb_backlight.color.center,
-		                      kb_backlight.color.right);
-		kb_8_color__set_brightness(kb_backlight.brightness);
-		kb_8_color__set_state(KB_STATE_ON);
+		                      kb_backlight.color.right, source);
+		kb_8_color__set_brightness(kb_backlight.brightness, source);
+		kb_8_color__set_state(KB_STATE_ON, source);
 	}
 }
 
@@ -691,6 +924,365 @@ static struct kb_backlight_ops kb_8_color_ops = {
 };
 
 
+/* firmware command calibration */
+
+static bool param_kb_calibrate = false;
+module_param_named(kb_calibrate, param_kb_calibrate, bool, 0);
+MODULE_PARM_DESC(kb_calibrate, "Measure keyboard backlight command throughput at load time.");
+
+#define KB_CALIBRATE_BURST      50
+#define KB_CALIBRATE_ZONE_BURST 10
+
+/* measured values, 0 until calibrated */
+static unsigned int param_kb_led_rate;
+module_param_named(kb_led_rate, param_kb_led_rate, uint, 0444);
+MODULE_PARM_DESC(kb_led_rate, "Keyboard backlight commands per second the firmware sustains");
+
+static unsigned int param_kb_led_latency;
+module_param_named(kb_led_latency, param_kb_led_latency, uint, 0444);
+MODULE_PARM_DESC(kb_led_latency, "Average keyboard backlight command latency (us)");
+
+static unsigned int param_kb_led_latency_max;
+module_param_named(kb_led_latency_max, param_kb_led_latency_max, uint, 0444);
+MODULE_PARM_DESC(kb_led_latency_max, "Maximum keyboard backlight command latency (us)");
+
+static unsigned int param_kb_zone_rate;
+module_param_named(kb_zone_rate, param_kb_zone_rate, uint, 0444);
+MODULE_PARM_DESC(kb_zone_rate, "Keyboard zone color writes per second the firmware sustains");
+
+/*
+ * Times count rewrites of what the keyboard currently shows, returns total
+ * time in us and stores the slowest one. A zone write reprograms the whole
+ * custom mode, colors and brightness, i.e. several SET_KB_LED commands.
+ */
+static s64 kb_calibrate_burst(bool zone, unsigned int count, s64 *latency_max)
+{
+	ktime_t start, prev, now;
+	s64 latency;
+	unsigned int i;
+
+	*latency_max = 0;
+	start = prev = ktime_get();
+
+	for (i = 0; i < count; i++) {
+		if (zone)
+			kb_backlight.ops->set_mode(KB_MODE_CUSTOM, JOURNAL_SOURCE_CALIBRATE);
+		else
+			kb_backlight.ops->set_brightness(kb_backlight.brightness, JOURNAL_SOURCE_CALIBRATE);
+
+		now = ktime_get();
+		latency = ktime_us_delta(now, prev);
+		if (latency > *latency_max)
+			*latency_max = latency;
+		prev = now;
+	}
+
+	return ktime_us_delta(prev, start);
+}
+
+/*
+ * Times a burst of single SET_KB_LED commands, then a burst of zone writes
+ * as param_set_kb_left & co. do them. Backlight has to be on and in custom
+ * mode, otherwise the commands would change its state.
+ */
+static int kb_calibrate(void)
+{
+	s64 latency_max, total;
+
+	if (!kb_backlight.ops)
+		return -ENODEV;
+
+	if (kb_backlight.state == KB_STATE_OFF || kb_backlight.mode != KB_MODE_CUSTOM)
+		return -EBUSY;
+
+	total = kb_calibrate_burst(false, KB_CALIBRATE_BURST, &latency_max);
+
+	param_kb_led_latency = div_s64(total, KB_CALIBRATE_BURST);
+	param_kb_led_latency_max = latency_max;
+	param_kb_led_rate = total ? div_s64((s64) KB_CALIBRATE_BURST * USEC_PER_SEC, total) : 0;
+
+	total = kb_calibrate_burst(true, KB_CALIBRATE_ZONE_BURST, &latency_max);
+
+	param_kb_zone_rate = total ? div_s64((s64) KB_CALIBRATE_ZONE_BURST * USEC_PER_SEC, total) : 0;
+
+	TUXEDO_INFO("Keyboard backlight: %u commands/s, latency %u us (max %u us), %u zone writes/s\n",
+	            param_kb_led_rate, param_kb_led_latency, param_kb_led_latency_max,
+	            param_kb_zone_rate);
+
+	return 0;
+}
+
+static struct dentry *tuxedo_debugfs_dir;
+
+/* serializes with parameter writes, which run with it held */
+static void tuxedo_param_lock(void)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0)
+	__kernel_param_lock();
+#else
+	kernel_param_lock(THIS_MODULE);
+#endif
+}
+
+static void tuxedo_param_unlock(void)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0)
+	__kernel_param_unlock();
+#else
+	kernel_param_unlock(THIS_MODULE);
+#endif
+}
+
+/* any write runs calibration again */
+static ssize_t kb_calibrate_write(struct file *file, const char __user *buf,
+                                  size_t count, loff_t *ppos)
+{
+	int err;
+
+	/* keeps parameter writes from changing keyboard state under the burst */
+	tuxedo_param_lock();
+	err = kb_calibrate();
+	tuxedo_param_unlock();
+
+	return err ? err : count;
+}
+
+static const struct file_operations kb_calibrate_fops = {
+	.owner  = THIS_MODULE,
+	.open   = simple_open,
+	.write  = kb_calibrate_write,
+	.llseek = noop_llseek,
+};
+
+static void __init tuxedo_debugfs_init(void)
+{
+	tuxedo_debugfs_dir = debugfs_create_dir(TUXEDO_DRIVER_NAME, NULL);
+	if (IS_ERR_OR_NULL(tuxedo_debugfs_dir))
+		return;
+
+	debugfs_create_file("kb_calibrate", 0200, tuxedo_debugfs_dir, NULL,
+	                    &kb_calibrate_fops);
+	BUILD_BUG_ON(sizeof(struct tuxedo_journal_entry) != 24);
+	debugfs_create_file("journal", 0400, tuxedo_debugfs_dir, NULL,
+	                    &tuxedo_journal_fops);
+}
+
+static void __exit tuxedo_debugfs_exit(void)
+{
+	debugfs_remove_recursive(tuxedo_debugfs_dir);
+}
+
+
+/* typing idle dimming */
+
+static unsigned int param_kb_idle_timeout = 0;
+static unsigned int param_kb_idle_brightness = 0;
+module_param_named(kb_idle_brightness, param_kb_idle_brightness, uint, 0644);
+MODULE_PARM_DESC(kb_idle_brightness, "Brightness the keyboard backlight fades to when idle (from 0 to 10)");
+
+static unsigned int param_kb_idle_fade_ms = 100;
+module_param_named(kb_idle_fade_ms, param_kb_idle_fade_ms, uint, 0644);
+MODULE_PARM_DESC(kb_idle_fade_ms, "Time between brightness steps of the idle fade (ms)");
+
+static void kb_idle_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(kb_idle_work, kb_idle_work_fn);
+
+static unsigned long kb_idle_last_activity;  /* jiffies of last key press */
+static bool kb_idle_dimmed;                  /* fading out or faded out */
+static unsigned kb_idle_saved;               /* brightness to restore */
+static bool kb_idle_registered;
+static bool kb_idle_ready;
+
+static bool kb_idle_can_dim(void)
+{
+	return kb_backlight.ops && kb_backlight.state == KB_STATE_ON &&
+	       kb_backlight.mode == KB_MODE_CUSTOM;
+}
+
+/*
+ * Key presses only store a timestamp, so typing costs no timer rearming:
+ * while keys are pressed the work wakes up once per timeout, and once the
+ * fade is over nothing runs until the next key press. Brightness always
+ * changes through kb_backlight.ops under the parameter lock, as sysfs
+ * writes do.
+ */
+static void kb_idle_work_fn(struct work_struct *work)
+{
+	unsigned long timeout = msecs_to_jiffies(READ_ONCE(param_kb_idle_timeout) * MSEC_PER_SEC);
+	unsigned long last = READ_ONCE(kb_idle_last_activity);
+	unsigned target = min_t(unsigned, READ_ONCE(param_kb_idle_brightness), KB_BRIGHTNESS_MAX);
+	bool active = !timeout || time_before(jiffies, last + timeout);
+
+	tuxedo_param_lock();
+
+	if (kb_idle_dimmed && active) {
+		/* first key press, or dimming turned off */
+		WRITE_ONCE(kb_idle_dimmed, false);
+		if (kb_idle_can_dim() && kb_backlight.brightness != kb_idle_saved)
+			kb_backlight.ops->set_brightness(kb_idle_saved, JOURNAL_SOURCE_IDLE);
+	} else if (!active) {
+		if (!kb_idle_dimmed) {
+			kb_idle_saved = kb_backlight.brightness;
+			WRITE_ONCE(kb_idle_dimmed, true);
+		}
+		if (kb_idle_can_dim() && kb_backlight.brightness > target) {
+			kb_backlight.ops->set_brightness(kb_backlight.brightness - 1, JOURNAL_SOURCE_IDLE);
+			schedule_delayed_work(&kb_idle_work,
+			                      msecs_to_jiffies(READ_ONCE(param_kb_idle_fade_ms)));
+		}
+		goto unlock;
+	}
+
+	if (timeout)
+		schedule_delayed_work(&kb_idle_work, last + timeout - jiffies);
+
+unlock:
+	tuxedo_param_unlock();
+}
+
+/* counts as activity, so an explicit brightness change is what gets restored */
+static void kb_idle_touch(void)
+{
+	WRITE_ONCE(kb_idle_last_activity, jiffies);
+	WRITE_ONCE(kb_idle_dimmed, false);
+}
+
+/* runs in atomic context, for every event of every keyboard */
+static void kb_idle_event(struct input_handle *handle, unsigned int type,
+                          unsigned int code, int value)
+{
+	if (type != EV_KEY)
+		return;
+
+	WRITE_ONCE(kb_idle_last_activity, jiffies);
+
+	if (unlikely(READ_ONCE(kb_idle_dimmed)))
+		mod_delayed_work(system_wq, &kb_idle_work, 0);
+}
+
+static int kb_idle_connect(struct input_handler *handler, struct input_dev *dev,
+                           const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int err;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = TUXEDO_DRIVER_NAME "-idle";
+
+	err = input_register_handle(handle);
+	if (err)
+		goto err_free_handle;
+
+	err = input_open_device(handle);
+	if (err)
+		goto err_unregister_handle;
+
+	return 0;
+
+err_unregister_handle:
+	input_unregister_handle(handle);
+err_free_handle:
+	kfree(handle);
+	return err;
+}
+
+static void kb_idle_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+/* anything with letter keys, which leaves out our own hotkey device */
+static const struct input_device_id kb_idle_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_KEYBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+		.keybit = { [BIT_WORD(KEY_A)] = BIT_MASK(KEY_A) },
+	},
+	{ },
+};
+
+static struct input_handler kb_idle_handler = {
+	.event      = kb_idle_event,
+	.connect    = kb_idle_connect,
+	.disconnect = kb_idle_disconnect,
+	.name       = TUXEDO_DRIVER_NAME "-idle",
+	.id_table   = kb_idle_ids,
+};
+
+/* call with parameter lock held */
+static void kb_idle_update(void)
+{
+	if (param_kb_idle_timeout && !kb_idle_registered) {
+		kb_idle_touch();
+		if (input_register_handler(&kb_idle_handler))
+			TUXEDO_ERROR("Could not register idle input handler\n");
+		else
+			kb_idle_registered = true;
+	} else if (!param_kb_idle_timeout && kb_idle_registered) {
+		input_unregister_handler(&kb_idle_handler);
+		kb_idle_registered = false;
+	}
+
+	/* picks up new timeout, or restores brightness when turned off */
+	mod_delayed_work(system_wq, &kb_idle_work, 0);
+}
+
+static int param_set_kb_idle_timeout(const char *val, const struct kernel_param *kp)
+{
+	int ret;
+
+	TUXEDO_DEBUG();
+
+	ret = param_set_uint(val, kp);
+
+	/* at load time this runs before tuxedo_init, which does the update */
+	if (!ret && kb_idle_ready)
+		kb_idle_update();
+
+	return ret;
+}
+
+static const struct kernel_param_ops param_ops_kb_idle_timeout = {
+	.set = param_set_kb_idle_timeout,
+	.get = param_get_uint,
+};
+
+#define param_check_kb_idle_timeout param_check_uint
+module_param_named(kb_idle_timeout, param_kb_idle_timeout, kb_idle_timeout, 0644);
+MODULE_PARM_DESC(kb_idle_timeout, "Fade keyboard backlight out after this many seconds without typing (0 to disable)");
+
+static void __init kb_idle_init(void)
+{
+	tuxedo_param_lock();
+	kb_idle_ready = true;
+	if (param_kb_idle_timeout)
+		kb_idle_update();
+	tuxedo_param_unlock();
+}
+
+static void __exit kb_idle_exit(void)
+{
+	tuxedo_param_lock();
+	kb_idle_ready = false;
+	if (kb_idle_registered)
+		input_unregister_handler(&kb_idle_handler);
+	kb_idle_registered = false;
+	tuxedo_param_unlock();
+
+	cancel_delayed_work_sync(&kb_idle_work);
+
+	if (kb_idle_dimmed && kb_idle_can_dim())
+		kb_backlight.ops->set_brightness(kb_idle_saved, JOURNAL_SOURCE_IDLE);
+}
+
+
 static void tuxedo_wmi_notify(u32 value, void *context)
 {
 	static unsigned int report_cnt = 0;
@@ -702,7 +1294,7 @@ static void tuxedo_wmi_notify(u32 value, void *context)
 		return;
 	}
 
-	tuxedo_wmi_evaluate_wmbb_method(GET_EVENT, 0, &event);
+	tuxedo_wmi_evaluate_wmbb_method(GET_EVENT, 0, &event, JOURNAL_SOURCE_HOTKEY);
 
 	switch (event) {
 	case 0xF4:
@@ -732,16 +1324,22 @@ static void tuxedo_wmi_notify(u32 value, void *context)
 
 		switch (event) {
 		case 0x81:
-			kb_dec_brightness();
-			break;
 		case 0x82:
-			kb_inc_brightness();
+			/* serialized with idle work, so it never restores an older level */
+			tuxedo_param_lock();
+			if (event == 0x81)
+				kb_dec_brightness(JOURNAL_SOURCE_HOTKEY);
+			else
+				kb_inc_brightness(JOURNAL_SOURCE_HOTKEY);
+			kb_idle_touch();
+			kb_idle_saved = kb_backlight.brightness;
+			tuxedo_param_unlock();
 			break;
 		case 0x83:
-			kb_next_mode();
+			kb_next_mode(JOURNAL_SOURCE_HOTKEY);
 			break;
 		case 0x9F:
-			kb_toggle_state();
+			kb_toggle_state(JOURNAL_SOURCE_HOTKEY);
 			break;
 		}
 		break;
@@ -760,10 +1358,10 @@ static int tuxedo_wmi_probe(struct platform_device *dev)
 		return -EIO;
 	}
 
-	tuxedo_wmi_evaluate_wmbb_method(GET_AP, 0, NULL);
+	tuxedo_wmi_evaluate_wmbb_method(GET_AP, 0, NULL, JOURNAL_SOURCE_INIT);
 
 	if (kb_backlight.ops)
-		kb_backlight.ops->init();
+		kb_backlight.ops->init(JOURNAL_SOURCE_INIT);
 
 	return 0;
 }
@@ -776,10 +1374,13 @@ static int tuxedo_wmi_remove(struct platform_device *dev)
 
 static int tuxedo_wmi_resume(struct platform_device *dev)
 {
-	tuxedo_wmi_evaluate_wmbb_method(GET_AP, 0, NULL);
+
+	tuxedo_ec_invalidate();
+
+	tuxedo_wmi_evaluate_wmbb_method(GET_AP, 0, NULL, JOURNAL_SOURCE_RESUME);
 
 	if (kb_backlight.ops && kb_backlight.state == KB_STATE_ON)
-		kb_backlight.ops->set_mode(kb_backlight.mode);
+		kb_backlight.ops->set_mode(kb_backlight.mode, JOURNAL_SOURCE_RESUME);
 
 	return 0;
 }
@@ -800,6 +1401,29 @@ static bool param_led_invert = false;
 module_param_named(led_invert, param_led_invert, bool, 0);
 MODULE_PARM_DESC(led_invert, "Invert airplane mode LED state.");
 
+static int airplane_led_set_blocking(struct led_classdev *led_cdev,
+                                     enum led_brightness value)
+{
+	bool on = (value != LED_OFF) != param_led_invert;
+
+	return tuxedo_ec_update_bits(EC_REG_AIRPLANE_LED, EC_AIRPLANE_LED,
+	                             on ? EC_AIRPLANE_LED : 0, NULL);
+
+	/* wmbb 0x6C 1 (?) */
+}
+
+static enum led_brightness airplane_led_get(struct led_classdev *led_cdev)
+{
+	u8 byte;
+
+	if (tuxedo_ec_read_bits(EC_REG_AIRPLANE_LED, EC_AIRPLANE_LED, &byte))
+		return LED_OFF;
+
+	return !!(byte & EC_AIRPLANE_LED) != param_led_invert ? LED_FULL : LED_OFF;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
+/* no brightness_set_blocking yet, so setting the LED is deferred to a workqueue */
 static struct workqueue_struct *led_workqueue;
 
 static struct _led_work {
@@ -809,31 +1433,11 @@ static struct _led_work {
 
 static void airplane_led_update(struct work_struct *work)
 {
-	u8 byte;
 	struct _led_work *w;
 
 	w = container_of(work, struct _led_work, work);
 
-	ec_read(0xD9, &byte);
-
-	if (param_led_invert)
-		ec_write(0xD9, w->wk ? byte & ~0x40 : byte | 0x40);
-	else
-		ec_write(0xD9, w->wk ? byte | 0x40 : byte & ~0x40);
-
-	/* wmbb 0x6C 1 (?) */
-}
-
-static enum led_brightness airplane_led_get(struct led_classdev *led_cdev)
-{
-	u8 byte;
-
-	ec_read(0xD9, &byte);
-
-	if (param_led_invert)
-		return byte & 0x40 ? LED_OFF : LED_FULL;
-	else
-		return byte & 0x40 ? LED_FULL : LED_OFF;
+	airplane_led_set_blocking(NULL, w->wk);
 }
 
 /* must not sleep */
@@ -843,11 +1447,16 @@ static void airplane_led_set(struct led_classdev *led_cdev,
 	led_work.wk = value;
 	queue_work(led_workqueue, &led_work.work);
 }
+#endif
 
 static struct led_classdev airplane_led = {
 	.name = "tuxedo::airplane",
 	.brightness_get = airplane_led_get,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
 	.brightness_set = airplane_led_set,
+#else
+	.brightness_set_blocking = airplane_led_set_blocking,
+#endif
 	.max_brightness = 1,
 };
 
@@ -855,11 +1464,13 @@ static int __init tuxedo_led_init(void)
 {
 	int err;
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
 	led_workqueue = create_singlethread_workqueue("led_workqueue");
 	if (unlikely(!led_workqueue))
 		return -ENOMEM;
 
 	INIT_WORK(&led_work.work, airplane_led_update);
+#endif
 
 	err = led_classdev_register(&tuxedo_platform_device->dev, &airplane_led);
 	if (unlikely(err))
@@ -868,8 +1479,10 @@ static int __init tuxedo_led_init(void)
 	return 0;
 
 err_destroy_workqueue:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
 	destroy_workqueue(led_workqueue);
 	led_workqueue = NULL;
+#endif
 
 	return err;
 }
@@ -878,8 +1491,10 @@ static void __exit tuxedo_led_exit(void)
 {
 	if (!IS_ERR_OR_NULL(airplane_led.dev))
 		led_classdev_unregister(&airplane_led);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
 	if (led_workqueue)
 		destroy_workqueue(led_workqueue);
+#endif
 }
 
 
@@ -895,7 +1510,7 @@ static int tuxedo_wwan_rfkill_set_block(void *data, bool blocked)
 {
 	TUXEDO_DEBUG("blocked=%i\n", blocked);
 
-	if (tuxedo_wmi_evaluate_wmbb_method(SET_3G, !blocked, NULL))
+	if (tuxedo_wmi_evaluate_wmbb_method(SET_3G, !blocked, NULL, JOURNAL_SOURCE_RFKILL))
 		TUXEDO_ERROR("Setting 3G power state failed!\n");
 	return 0;
 }
@@ -912,7 +1527,7 @@ static int __init tuxedo_rfkill_init(void)
 	if (!param_rfkill)
 		return 0;
 
-	tuxedo_wmi_evaluate_wmbb_method(TALK_BIOS_3G, 1, NULL);
+	tuxedo_wmi_evaluate_wmbb_method(TALK_BIOS_3G, 1, NULL, JOURNAL_SOURCE_INIT);
 
 	tuxedo_wwan_rfkill_device = rfkill_alloc("tuxedo-wwan",
 	                                         &tuxedo_platform_device->dev,
@@ -925,7 +1540,7 @@ static int __init tuxedo_rfkill_init(void)
 	if (unlikely(err))
 		goto err_destroy_wwan;
 
-	if (tuxedo_wmi_evaluate_wmbb_method(GET_POWER_STATE_FOR_3G, 0, &unblocked))
+	if (tuxedo_wmi_evaluate_wmbb_method(GET_POWER_STATE_FOR_3G, 0, &unblocked, JOURNAL_SOURCE_INIT))
 		TUXEDO_ERROR("Could not get 3G power state!\n");
 	else
 		rfkill_set_sw_state(tuxedo_wwan_rfkill_device, !unblocked);
@@ -934,7 +1549,7 @@ static int __init tuxedo_rfkill_init(void)
 
 err_destroy_wwan:
 	rfkill_destroy(tuxedo_wwan_rfkill_device);
-	tuxedo_wmi_evaluate_wmbb_method(TALK_BIOS_3G, 0, NULL);
+	tuxedo_wmi_evaluate_wmbb_method(TALK_BIOS_3G, 0, NULL, JOURNAL_SOURCE_INIT);
 	return err;
 }
 
@@ -943,7 +1558,7 @@ static void __exit tuxedo_rfkill_exit(void)
 	if (!tuxedo_wwan_rfkill_device)
 		return;
 
-	tuxedo_wmi_evaluate_wmbb_method(TALK_BIOS_3G, 0, NULL);
+	tuxedo_wmi_evaluate_wmbb_method(TALK_BIOS_3G, 0, NULL, JOURNAL_SOURCE_EXIT);
 
 	rfkill_unregister(tuxedo_wwan_rfkill_device);
 	rfkill_destroy(tuxedo_wwan_rfkill_device);
@@ -1089,8 +1704,14 @@ static int __init tuxedo_init(void)
 	if (unlikely(err))
 		TUXEDO_ERROR("Could not register LED device\n");
 
-	kb_backlight.ops->set_mode(KB_MODE_CUSTOM);
-	kb_backlight.ops->init();
+	kb_backlight.ops->set_mode(KB_MODE_CUSTOM, JOURNAL_SOURCE_INIT);
+	kb_backlight.ops->init(JOURNAL_SOURCE_INIT);
+
+	if (param_kb_calibrate && kb_calibrate())
+		TUXEDO_ERROR("Could not calibrate keyboard backlight\n");
+
+	kb_idle_init();
+	tuxedo_debugfs_init();
 
 	return 0;
 }
@@ -1107,8 +1728,10 @@ static int param_set_kb_brightness(const char *val, const struct kernel_param *k
 	if (!ret && *((unsigned char *) kp->arg) > KB_BRIGHTNESS_MAX)
 		return -EINVAL;
 
+	kb_idle_touch();
+
 	if (!(kb_backlight.state == KB_STATE_OFF || kb_backlight.mode != KB_MODE_CUSTOM))
-		kb_backlight.ops->set_brightness(*((unsigned char *) kp->arg));
+		kb_backlight.ops->set_brightness(*((unsigned char *) kp->arg), JOURNAL_SOURCE_SYSFS);
 
 	return ret;
 }
@@ -1147,7 +1770,7 @@ static int param_set_kb_left(const char *val, const struct kernel_param *kp)
 
 	if (!(kb_backlight.state == KB_STATE_OFF || kb_backlight.mode != KB_MODE_CUSTOM)) {
 		kb_backlight.color.left = *((unsigned char *) kp->arg);
-		kb_backlight.ops->set_mode(KB_MODE_CUSTOM);
+		kb_backlight.ops->set_mode(KB_MODE_CUSTOM, JOURNAL_SOURCE_SYSFS);
 	}
 
 	return ret;
@@ -1185,7 +1808,7 @@ static int param_set_kb_center(const char *val, const struct kernel_param *kp)
 
 	if (!(kb_backlight.state == KB_STATE_OFF || kb_backlight.mode != KB_MODE_CUSTOM)) {
 		kb_backlight.color.center = *((unsigned char *) kp->arg);
-		kb_backlight.ops->set_mode(KB_MODE_CUSTOM);
+		kb_backlight.ops->set_mode(KB_MODE_CUSTOM, JOURNAL_SOURCE_SYSFS);
 	}
 
 	return ret;
@@ -1223,7 +1846,7 @@ static int param_set_kb_right(const char *val, const struct kernel_param *kp)
 
 	if (!(kb_backlight.state == KB_STATE_OFF || kb_backlight.mode != KB_MODE_CUSTOM)) {
 		kb_backlight.color.right = *((unsigned char *) kp->arg);
-		kb_backlight.ops->set_mode(KB_MODE_CUSTOM);
+		kb_backlight.ops->set_mode(KB_MODE_CUSTOM, JOURNAL_SOURCE_SYSFS);
 	}
 
 	return ret;
@@ -1256,7 +1879,7 @@ static int param_set_kb_off(const char *val, const struct kernel_param *kp)
 
 	ret = param_set_bool(val, kp);
 
-	kb_backlight.ops->set_state((*((unsigned char *) kp->arg) ? KB_STATE_OFF : KB_STATE_ON));
+	kb_backlight.ops->set_state((*((unsigned char *) kp->arg) ? KB_STATE_OFF : KB_STATE_ON), JOURNAL_SOURCE_SYSFS);
 
 	return ret;
 }
@@ -1279,6 +1902,8 @@ MODULE_PARM_DESC(kb_off, "Switch keyboard backlight off");
 
 static void __exit tuxedo_exit(void)
 {
+	tuxedo_debugfs_exit();
+	kb_idle_exit();
 	tuxedo_led_exit();
 	tuxedo_input_exit();
 	tuxedo_rfkill_exit();
@@ -1,3 +1,9 @@
 __author__ = 'ejcosta'
 
-from .keyboard import Keyboard
\ No newline at end of file
+from .keyboard import Keyboard
+from .frame import Frame
+from .backends import (
+    Backend,
+    BackendWorker,
+    make_backend,
+)
@@ -0,0 +1,208 @@
+__author__ = 'ejcosta'
+
+import os
+import time
+import threading
+from .frame import Frame
+
+# RGB of each keyboard color, copied from driver color table (COLORS in tuxedo-wmi.c),
+# colors it doesn't have (aqua) are shown as off, WMI keyboard can't display them either
+colors_rgb = {
+    'off':    (0x00, 0x00, 0x00),
+    'blue':   (0x00, 0x00, 0xFF),
+    'red':    (0xFF, 0x00, 0x00),
+    'purple': (0xFF, 0x00, 0xFF),
+    'green':  (0x00, 0xFF, 0x00),
+    'ice':    (0x00, 0xFF, 0xFF),
+    'yellow': (0xFF, 0xFF, 0x00),
+    'white':  (0xFF, 0xFF, 0xFF),
+}
+
+
+class Backend(object):
+    """ Device frames are drawn on, commit applies a whole frame at once and returns what it changed """
+
+    name = None
+    brightness_max = 10
+    reads = 0
+    writes = 0
+
+    def get_frame(self):
+        raise NotImplementedError
+
+    def commit(self, frame):
+        raise NotImplementedError
+
+    def resync(self):
+        pass
+
+    def close(self):
+        pass
+
+
+class StateBackend(Backend):
+    """ Backend of a device that can't be read back, what it shows is what was last written to it """
+
+    def __init__(self, name):
+        self.name = name
+        # nothing known until first commit, which writes everything
+        self.frame = Frame()
+
+    def get_frame(self):
+        return Frame(self.frame.colors, self.frame.brightness, self.frame.state_off)
+
+    def commit(self, frame):
+        changes = frame.diff(self.frame)
+        if not changes.is_empty():
+            frame = self.frame.merge(changes)
+            # a failed write leaves device state unknown to be written again
+            self.write(frame, changes)
+            self.frame = frame
+        return changes
+
+    def write(self, frame, changes):
+        """ Shows frame (every field known so far) on device, changes holds fields that differ """
+        raise NotImplementedError
+
+
+class FakeBackend(StateBackend):
+    """ In-memory device for tests, delay (in seconds) stands in for a slow one """
+
+    def __init__(self, name='fake', delay=0):
+        StateBackend.__init__(self, name)
+        self.delay = float(delay)
+        self.commits = []
+
+    def write(self, frame, changes):
+        if self.delay:
+            time.sleep(self.delay)
+        self.commits.append(changes)
+        self.writes += 1
+
+
+class HidrawBackend(StateBackend):
+    """ USB RGB device taking one output report per zone: report id, zone index, red, green and blue
+
+    zones lists keyboard section shown by each device zone, in device order. Devices speaking
+    another protocol only need their own encode().
+    """
+
+    def __init__(self, name, path, zones=Frame.sections, report_id=0):
+        StateBackend.__init__(self, name)
+        self.zones = tuple(zones)
+        self.report_id = int(report_id)
+        self.fd = os.open(path, os.O_WRONLY)
+        self.shown = [None] * len(self.zones)
+
+    def close(self):
+        os.close(self.fd)
+
+    def encode(self, index, rgb):
+        return bytearray([self.report_id, index] + list(rgb))
+
+    def write(self, frame, changes):
+        # brightness is applied to color, off shows black
+        level = 0 if frame.state_off else (self.brightness_max if frame.brightness is None else frame.brightness)
+        for index, section in enumerate(self.zones):
+            color = colors_rgb.get(frame.colors.get(section), colors_rgb['off'])
+            rgb = tuple(c * level // self.brightness_max for c in color)
+            if rgb != self.shown[index]:
+                os.write(self.fd, bytes(self.encode(index, rgb)))
+                self.shown[index] = rgb
+                self.writes += 1
+
+
+class BackendWorker(object):
+    """ Commits frames to a backend on its own thread, so a slow device never holds back the others
+
+    Only latest frame submitted is kept, frames a busy backend couldn't keep up with are dropped.
+    """
+
+    def __init__(self, backend):
+        self.backend = backend
+        self.pending = None
+        self.last = None
+        self.closing = False
+        self.condition = threading.Condition()
+        self.committed = 0
+        self.dropped = 0
+        self.errors = 0
+        self.busy_seconds = 0.0
+        self.thread = threading.Thread(target=self._run, name='backend-{}'.format(backend.name))
+        self.thread.daemon = True
+        self.thread.start()
+
+    def submit(self, frame):
+        with self.condition:
+            # service commits a frame on every tick, device only hears about ones that differ
+            if frame == self.last:
+                return
+            # service may go on changing frame it handed over, worker keeps its own copy
+            frame = Frame().merge(frame)
+            self.last = frame
+            if self.pending is not None:
+                self.dropped += 1
+                # fields of dropped frame this one leaves unset still have to reach device
+                frame = self.pending.merge(frame)
+            self.pending = frame
+            self.condition.notify()
+
+    def _run(self):
+        while True:
+            with self.condition:
+                while self.pending is None and not self.closing:
+                    self.condition.wait()
+                if self.pending is None:
+                    return
+                frame, self.pending = self.pending, None
+            start = time.time()
+            try:
+                self.backend.commit(frame)
+                self.committed += 1
+            except (OSError, IOError) as e:
+                self.errors += 1
+                print "Can't commit frame to {}: {}".format(self.backend.name, e)
+                # next frame submitted is committed even if it's the same one
+                with self.condition:
+                    self.last = None
+            self.busy_seconds += time.time() - start
+
+    def close(self, timeout=1.0):
+        """ Waits (up to timeout seconds) for pending frame to reach device, then stops thread """
+        with self.condition:
+            self.closing = True
+            self.condition.notify()
+        self.thread.join(timeout)
+        if self.thread.is_alive():
+            # still writing, closing its fd could send that write to whatever reuses the number
+            print "Backend {} still busy, left open".format(self.backend.name)
+            return
+        self.backend.close()
+
+
+def make_backend(name, options):
+    """ Builds a backend from its config options (type and type specific ones) """
+    kind = options.get('type', 'sysfs')
+    if kind == 'sysfs':
+        from .keyboard import Keyboard
+        backend = Keyboard(options.get('location', '/sys/module/tuxedo_wmi/parameters/'))
+        backend.name = name
+        return backend
+    if kind == 'hidraw':
+        return HidrawBackend(name, options['path'], options.get('zones', ' '.join(Frame.sections)).split(),
+                             options.get('report_id', 0))
+    if kind == 'fake':
+        return FakeBackend(name, options.get('delay', 0))
+    raise ValueError("Unknown backend type {} for {}".format(kind, name))
+
+
+if __name__ == "__main__":
+    # slow fake device only ever gets latest frame, submitting never waits for it
+    worker = BackendWorker(FakeBackend('slow', delay=0.1))
+    start = time.time()
+    for color in ('red', 'green', 'blue', 'yellow', 'white'):
+        worker.submit(Frame({'left': color, 'center': color, 'right': color}, 10))
+    print "Submitted 5 frames in {:.3f}ms".format((time.time() - start) * 1000)
+    worker.close()
+    print "Committed {}, dropped {}, device shows {}".format(worker.committed, worker.dropped,
+                                                             worker.backend.get_frame())
@@ -0,0 +1,50 @@
+__author__ = 'ejcosta'
+
+
+class Frame(object):
+    """ Desired keyboard state for one update, fields left as None are not touched """
+
+    sections = ('left', 'center', 'right')
+
+    def __init__(self, colors=None, brightness=None, state_off=None):
+        self.colors = dict(colors or {})
+        self.brightness = brightness
+        self.state_off = state_off
+
+    def set_color(self, section, color):
+        if section in self.sections:
+            self.colors[section] = color
+
+    def merge(self, other):
+        """ Returns a new frame with fields set on other taking precedence """
+        frame = Frame(self.colors, self.brightness, self.state_off)
+        frame.colors.update(other.colors)
+        if other.brightness is not None:
+            frame.brightness = other.brightness
+        if other.state_off is not None:
+            frame.state_off = other.state_off
+        return frame
+
+    def diff(self, other):
+        """ Returns a frame holding only the fields of this frame that differ from other """
+        frame = Frame()
+        for section, color in self.colors.items():
+            if other.colors.get(section) != color:
+                frame.colors[section] = color
+        if self.brightness is not None and self.brightness != other.brightness:
+            frame.brightness = self.brightness
+        if self.state_off is not None and self.state_off != other.state_off:
+            frame.state_off = self.state_off
+        return frame
+
+    def is_empty(self):
+        return not self.colors and self.brightness is None and self.state_off is None
+
+    def __eq__(self, other):
+        return isinstance(other, Frame) and self.diff(other).is_empty() and other.diff(self).is_empty()
+
+    def __ne__(self, other):
+        return not self == other
+
+    def __repr__(self):
+        return "Frame(colors={}, brightness={}, state_off={})".format(self.colors, self.brightness, self.state_off)
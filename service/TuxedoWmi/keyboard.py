@@ -1,12 +1,17 @@
 __author__ = 'ejcosta'
 
 import os
+from .frame import Frame
+from .backends import Backend
 
 
-class Keyboard(object):
+class Keyboard(Backend):
+    """ Tuxedo driver backend, zones and brightness are kernel parameters under driver_location """
+    name = 'tuxedo'
     driver_location = ""
     driver_ok = False
     brightness = 10
+    brightness_max = 10
     state_off = False
     colors_code = {
         'off':    '0',
@@ -19,6 +24,7 @@ class Keyboard(object):
         'white':  '7',
         'aqua':   '8',
     }
+    codes_color = dict((v, k) for k, v in colors_code.items())
     colors = {
         'left':   'blue',
         'center': 'blue',
@@ -26,15 +32,36 @@ class Keyboard(object):
 
     def __init__(self, driver_location):
         self.driver_location = driver_location
+        self.colors = dict(Keyboard.colors)
+        # Parameter files stay open for the object lifetime, every access is a single pread/pwrite at offset 0.
+        # Values last read from or written to the driver are cached, so getters never touch sysfs.
+        self.fds = {}
+        self.cache = {}
+        self.reads = 0
+        self.writes = 0
         if not self.check_driver():
             return
-        self.get_brightness()
-        self.get_colors(["left", "center", "right"])
+        self.resync()
 
     def check_driver(self):
         self.driver_ok = os.path.isdir(self.driver_location)
         return self.driver_ok
 
+    def resync(self):
+        """ Drop cached state and read every parameter back from the driver """
+        if not self.driver_ok:
+            return
+        self.cache.clear()
+        self.get_brightness()
+        self.get_state_off()
+        self.get_colors(["left", "center", "right"])
+
+    def close(self):
+        for fd in self.fds.values():
+            os.close(fd)
+        self.fds.clear()
+        self.cache.clear()
+
     """ Getters """
     def get_brightness(self):
         if not self.driver_ok:
@@ -48,13 +75,23 @@ class Keyboard(object):
         self.state_off = bool(int(self.__get_kernel_param("kb_off")))
         return self.state_off
 
+    def get_zone_rate(self):
+        """ Zone color writes per second driver measured firmware to sustain, None if it wasn't calibrated """
+        if not self.driver_ok:
+            return
+        try:
+            rate = int(self.__get_kernel_param("kb_zone_rate"))
+        except OSError:
+            # driver without calibration support
+            return
+        return rate or None
+
     def get_colors(self, kb_sections):
         if not self.driver_ok:
             return
         for section in kb_sections:
             if section in self.colors:
-                self.colors[section] = self.colors_code.keys()[self.colors_code.values()
-                    .index(self.__get_kernel_param("kb_{}".format(section)))]
+                self.colors[section] = self.codes_color[self.__get_kernel_param("kb_{}".format(section))]
         return self.colors
 
     """ Setters """
@@ -78,15 +115,88 @@ class Keyboard(object):
                 self.__set_kernel_param("kb_{}".format(section), self.colors_code[colors[section]])
         return self.get_colors(colors.keys())
 
+    """ Frames """
+    def get_frame(self):
+        return Frame(self.colors, self.brightness, self.state_off)
+
+    def diff(self, frame):
+        """ Returns the part of frame that would actually change the hardware """
+        changes = frame.diff(self.get_frame())
+        if frame.state_off or (frame.state_off is None and self.state_off):
+            # zones and brightness can't be programmed while lights are off
+            changes.colors = {}
+            changes.brightness = None
+        return changes
+
+    def commit(self, frame):
+        """ Applies frame with the fewest writes and returns the changes that were written """
+        if not self.driver_ok:
+            return Frame()
+        changes = self.diff(frame)
+        # Every zone write makes the driver reprogram all zones and brightness, so lights go on first,
+        # brightness is written after the zones and lights go off only after everything else.
+        if changes.state_off is False:
+            self.set_state_off(False)
+        if changes.colors:
+            self.set_colors(changes.colors)
+        if changes.brightness is not None:
+            self.set_brightness(changes.brightness)
+        if changes.state_off:
+            self.set_state_off(True)
+        return changes
+
     """ Kernel Ops """
+    def __get_fd(self, filename):
+        fd = self.fds.get(filename)
+        if fd is None:
+            path = self.driver_location + filename
+            try:
+                fd = os.open(path, os.O_RDWR)
+            except OSError:
+                # not running as root, parameters are still readable
+                fd = os.open(path, os.O_RDONLY)
+            self.fds[filename] = fd
+        return fd
+
+    def __read_kernel_param(self, filename):
+        fd = self.__get_fd(filename)
+        if hasattr(os, 'pread'):
+            data = os.pread(fd, 32, 0)
+        else:
+            os.lseek(fd, 0, os.SEEK_SET)
+            data = os.read(fd, 32)
+        self.reads += 1
+        val = str(int(data.splitlines()[0]))
+        self.cache[filename] = val
+        return val
+
     def __get_kernel_param(self, filename):
-        with open(self.driver_location + filename, 'r') as f:
-            return str(int([x for x in f][0]))
+        if filename in self.cache:
+            return self.cache[filename]
+        return self.__read_kernel_param(filename)
 
     def __set_kernel_param(self, filename, val):
-        if self.__get_kernel_param(filename) != val:
-            with open(self.driver_location + filename, 'w') as f:
-                f.write(val)
+        if self.__get_kernel_param(filename) == val:
+            return
+        fd = self.__get_fd(filename)
+        # trailing newline keeps the first line intact when a shorter value overwrites a longer one
+        data = (val + '\n').encode('ascii')
+        try:
+            if hasattr(os, 'pwrite'):
+                os.pwrite(fd, data, 0)
+            else:
+                os.lseek(fd, 0, os.SEEK_SET)
+                os.write(fd, data)
+            self.writes += 1
+        except OSError:
+            # driver rejected the value, keep whatever it reports
+            self.__read_kernel_param(filename)
+            raise
+        if self.state_off and filename != "kb_off":
+            # driver ignores zone and brightness updates while lights are off
+            self.__read_kernel_param(filename)
+        else:
+            self.cache[filename] = val
 
 if __name__ == "__main__":
     kb = Keyboard("/sys/module/tuxedo_wmi/parameters/")
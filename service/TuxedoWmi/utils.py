@@ -1,44 +1,118 @@
 __author__ = 'ejcosta'
 
-from threading import Thread
 import time
 
+from .frame import Frame
 
-def percent_to_kb_color(percent, thresholds):
-    if percent <= thresholds[0]:
-        return 'green'
-    if thresholds[0] < percent < thresholds[1]:
-        return 'yellow'
-    if percent >= thresholds[1]:
-        return 'red'
-
-
-class KeyboardDimThread(Thread):
-
-    wake_up_flag = False
-    initial_brightness = 10
-
-    def __init__(self, dim_delay, kb_driver):
-        Thread.__init__(self)
-        self.dim_delay = int(dim_delay)
-        self.kb_driver = kb_driver
-        self.initial_brightness = self.kb_driver.get_brightness()
-
-    def run(self):
-        try:
-            for x in xrange(self.dim_delay, -1, -1):
-                if x == 0:
-                    break
-                if self.wake_up_flag:
-                    break
-                brightness = self.kb_driver.get_brightness()
-                if brightness > x:
-                    self.kb_driver.set_brightness(x)
-                time.sleep(1)
-            if not self.wake_up_flag:
-                self.kb_driver.set_state_off(True)
-        except:
-            self.kb_driver.set_brightness(self.initial_brightness)
-
-    def wake_up(self):
-        self.wake_up_flag = True
\ No newline at end of file
+
+def get_option(config, section, option, default):
+    if config.has_option(section, option):
+        return config.get(section, option)
+    return default
+
+
+def get_boolean_option(config, section, option, default):
+    if config.has_option(section, option):
+        return config.getboolean(section, option)
+    return default
+
+
+kb_color_levels = ('green', 'yellow', 'red')
+
+
+def percent_to_kb_color(percent, thresholds, current=None, hysteresis=0, colors=kb_color_levels):
+    """ Picks colors[i] for percent, where thresholds separate consecutive colors """
+    if current in colors and hysteresis:
+        # Leaving current color requires crossing its threshold by hysteresis percent
+        level = colors.index(current)
+        rising = percent_to_kb_color(percent, [t + hysteresis for t in thresholds], colors=colors)
+        falling = percent_to_kb_color(percent, [t - hysteresis for t in thresholds], colors=colors)
+        if colors.index(rising) > level:
+            return rising
+        if colors.index(falling) < level:
+            return falling
+        return current
+    # lowest color includes its threshold, highest one starts at its threshold
+    level = 0
+    for i, threshold in enumerate(thresholds):
+        if percent > threshold or (i == len(thresholds) - 1 and percent >= threshold):
+            level = i + 1
+    return colors[level]
+
+
+class ColorFilter(object):
+    """ Smooths one metric and maps it to a color that doesn't flap around thresholds """
+
+    def __init__(self, thresholds, alpha=1.0, hysteresis=0, min_dwell=0, colors=kb_color_levels):
+        self.thresholds = thresholds
+        self.colors = colors
+        self.alpha = float(alpha)
+        self.hysteresis = float(hysteresis)
+        self.min_dwell = float(min_dwell)
+        self.value = None
+        self.delta = 0
+        self.color = None
+        self.since = 0
+        self.raw_color = None
+        # color changes plain thresholds would have made vs changes actually made
+        self.raw_changes = 0
+        self.changes = 0
+
+    def update(self, percent, now=None):
+        now = time.time() if now is None else now
+
+        raw_color = percent_to_kb_color(percent, self.thresholds, colors=self.colors)
+        if self.raw_color is not None and raw_color != self.raw_color:
+            self.raw_changes += 1
+        self.raw_color = raw_color
+
+        if self.value is None:
+            self.value = float(percent)
+        else:
+            self.delta = abs(percent - self.value)
+            self.value += self.alpha * (percent - self.value)
+
+        color = percent_to_kb_color(self.value, self.thresholds, self.color, self.hysteresis, self.colors)
+        if color != self.color:
+            if self.color is not None:
+                if now - self.since < self.min_dwell:
+                    return self.color
+                self.changes += 1
+            self.color = color
+            self.since = now
+        return self.color
+
+    def is_settled(self, margin):
+        """ True while readings are steady and far enough from every threshold """
+        if self.value is None:
+            return False
+        return self.delta < margin and all(abs(self.value - t) >= margin for t in self.thresholds)
+
+    def writes_saved(self):
+        return max(self.raw_changes - self.changes, 0)
+
+
+class Fade(object):
+    """ Brightness curve from start level down to zero, computed once with one step per level change,
+    last step turns lights off as brightness 0 alone doesn't make every keyboard dark """
+
+    def __init__(self, start, duration, now):
+        start = max(int(start), 0)
+        self.steps = [(now + float(duration) * k / start, start - k) for k in range(1, start + 1)] or [(now, 0)]
+        self.index = 0
+
+    def next_deadline(self):
+        if self.index < len(self.steps):
+            return self.steps[self.index][0]
+
+    def next_level(self):
+        level = self.steps[self.index][1]
+        self.index += 1
+        return level
+
+    def next_frame(self):
+        level = self.next_level()
+        return Frame(brightness=level, state_off=True if self.done() else None)
+
+    def done(self):
+        return self.index >= len(self.steps)
@@ -0,0 +1,61 @@
+__author__ = 'ejcosta'
+
+from TuxedoWmi import Frame
+
+
+class Layer(object):
+
+    def __init__(self, priority, frame, expires=None):
+        self.priority = priority
+        self.frame = frame
+        self.expires = expires
+
+
+class Compositor(object):
+    """ Blends layers from any number of clients into the single frame written to keyboard """
+
+    def __init__(self, base=None):
+        # base holds keyboard state shown where no layer sets a value
+        self.base = base or Frame()
+        self.layers = {}
+        # no layer can go brighter than this
+        self.brightness_cap = None
+
+    def submit(self, client, name, priority, frame, ttl=None, now=None):
+        """ Adds or replaces a client layer, layer goes away after ttl seconds when given """
+        expires = now + ttl if ttl else None
+        self.layers[(client, name)] = Layer(priority, frame, expires)
+
+    def remove(self, client, name):
+        return self.layers.pop((client, name), None) is not None
+
+    def remove_client(self, client):
+        for key in [key for key in self.layers if key[0] == client]:
+            del self.layers[key]
+
+    def expire(self, now):
+        for key in [key for key, layer in self.layers.items() if layer.expires is not None and layer.expires <= now]:
+            del self.layers[key]
+
+    def next_expiry(self):
+        expiries = [layer.expires for layer in self.layers.values() if layer.expires is not None]
+        return min(expiries) if expiries else None
+
+    def compose(self, now):
+        """ Returns base frame with layers applied from lowest to highest priority """
+        self.expire(now)
+        frame = self.base
+        for layer in sorted(self.layers.values(), key=lambda l: l.priority):
+            frame = frame.merge(layer.frame)
+        if self.brightness_cap is not None and frame.brightness is not None and frame.brightness > self.brightness_cap:
+            frame = frame.merge(Frame(brightness=self.brightness_cap))
+        return frame
+
+
+if __name__ == "__main__":
+    compositor = Compositor(Frame({'left': 'blue', 'center': 'blue', 'right': 'blue'}, 10, False))
+    compositor.submit('stats', 'cpu', 0, Frame({'right': 'red'}))
+    compositor.submit('build', 'status', 50, Frame({'right': 'green', 'left': 'green'}), ttl=5, now=0)
+    compositor.submit('dim', 'idle', 100, Frame(brightness=2))
+    print(compositor.compose(1))
+    print(compositor.compose(6))
@@ -1,25 +1,32 @@
 __author__ = 'ejcosta'
 
+import os
 import dbus
-from TuxedoWmi.utils import KeyboardDimThread
+import dbus.service
+import metrics
+from TuxedoWmi import (
+    Keyboard,
+    Frame,
+)
 
 
-def register_signal_watch(lp, cfg, kb_dvr):
-    global bus, config, kb_driver, loop, session, dim_thread
+LOGIN1 = "org.freedesktop.login1"
+LOGIN1_PATH = "/org/freedesktop/login1"
+LOGIN1_MANAGER = "org.freedesktop.login1.Manager"
+PROPERTIES = "org.freedesktop.DBus.Properties"
 
-    loop = lp
-    config = cfg
-    kb_driver = kb_dvr
-    bus_name = "org.freedesktop.login1"
-    bus = dbus.SystemBus()
-    dim_thread = KeyboardDimThread(config.get('service', 'dim_delay', 10), kb_driver)
+COMPOSITOR_NAME = "org.clevo.KeyboardBacklight"
+COMPOSITOR_PATH = "/org/clevo/KeyboardBacklight"
+COMPOSITOR_INTERFACE = "org.clevo.KeyboardBacklight.Compositor"
 
-    # Register signal handler for org.freedesktop.DBus.Properties.PropertiesChanged event.
-    # (for details see http://dbus.freedesktop.org/doc/dbus-specification.html#standard-interfaces-properties)
-    bus.add_signal_receiver(signal_handler,
-                            signal_name='PropertiesChanged',
-                            dbus_interface="org.freedesktop.DBus.Properties",
-                            path="/org/freedesktop/login1")
+
+def register_signal_watch(idle_callback):
+    global bus, seat, session, seat_match, session_match, on_idle_changed
+
+    on_idle_changed = idle_callback
+    bus = dbus.SystemBus()
+    session = None
+    session_match = None
 
     # Based on default seat we get active session in order to find his IdleHint parameter value.
     # This parameter changes between True and False based on session idle status.
@@ -27,55 +34,207 @@ def register_signal_watch(lp, cfg, kb_dvr):
 
     # Get default seat to find active session.
     # (on multi-seat configuration seat0 is always chosen)
-    seat = bus.get_object(bus_name, "/org/freedesktop/login1/seat/seat0")
+    seat = bus.get_object(LOGIN1, "/org/freedesktop/login1/seat/seat0")
 
-    # Session object active on default seat
-    session = bus.get_object(bus_name, seat.Get('org.freedesktop.login1.Seat','ActiveSession')[1])
+    # Register signal handler for org.freedesktop.DBus.Properties.PropertiesChanged event.
+    # (for details see http://dbus.freedesktop.org/doc/dbus-specification.html#standard-interfaces-properties)
+    # Match rules are filtered by bus daemon on object path and interface (arg0), so only signals
+    # we care about wake us up. Signals are dispatched by the main loop set as dbus default.
+    seat_match = bus.add_signal_receiver(seat_signal_handler,
+                                         signal_name='PropertiesChanged',
+                                         dbus_interface=PROPERTIES,
+                                         bus_name=LOGIN1,
+                                         path=seat.object_path,
+                                         arg0='org.freedesktop.login1.Seat')
+
+    _watch_session(seat.Get('org.freedesktop.login1.Seat', 'ActiveSession', dbus_interface=PROPERTIES)[1])
 
-    # Launch dbus main loop
-    loop.run()
+
+def _watch_session(session_path):
+    global session, session_match
+
+    if session_match is not None:
+        session_match.remove()
+        session_match = None
+
+    # No session is active on greeter or text consoles, logind reports '/' then
+    if session_path in ('', '/'):
+        session = None
+        return
+
+    # Session object active on default seat
+    session = bus.get_object(LOGIN1, session_path)
+    session_match = bus.add_signal_receiver(session_signal_handler,
+                                            signal_name='PropertiesChanged',
+                                            dbus_interface=PROPERTIES,
+                                            bus_name=LOGIN1,
+                                            path=session_path,
+                                            arg0='org.freedesktop.login1.Session')
 
 
 def unregister_signal_watch():
     try:
-        bus.remove_signal_receiver(signal_handler,
-                                   dbus_interface="org.freedesktop.DBus.Properties",
-                                   path="/org/freedesktop/login1")
+        seat_match.remove()
+        if session_match is not None:
+            session_match.remove()
     except:
         print "Exception on remove_signal_receiver!"
 
 
-def signal_handler(*args, **kwargs):
-    if 'IdleHint' in args[2]:
-        if session.Get('org.freedesktop.login1.Session', 'IdleHint'):
-            _dim_keyboard_lights()
-        else:
-            _power_up_keyboard_lights()
+def register_sleep_watch(sleep_callback):
+    """ Calls sleep_callback(True) before system suspends, and sleep_callback(False) once it resumed """
+    global sleep_match, on_prepare_for_sleep, sleep_inhibitor
 
+    on_prepare_for_sleep = sleep_callback
+    sleep_inhibitor = None
+    sleep_match = bus.add_signal_receiver(sleep_signal_handler,
+                                          signal_name='PrepareForSleep',
+                                          dbus_interface=LOGIN1_MANAGER,
+                                          bus_name=LOGIN1,
+                                          path=LOGIN1_PATH)
+    _take_sleep_inhibitor()
 
-def _dim_keyboard_lights():
-    global dim_thread
-    dim_thread = KeyboardDimThread(config.get('service', 'dim_delay', 10), kb_driver)
-    dim_thread.start()
 
+def unregister_sleep_watch():
+    sleep_match.remove()
+    release_sleep_inhibitor()
 
-def _power_up_keyboard_lights():
-    dim_thread.wake_up()
-    kb_driver.set_state_off(False)
-    kb_driver.set_brightness(dim_thread.initial_brightness)
+
+def _take_sleep_inhibitor():
+    global sleep_inhibitor
+    # A delay lock holds suspend back (up to logind InhibitDelayMaxSec) until it's released,
+    # so keyboard writes in flight finish before the machine goes down
+    try:
+        manager = bus.get_object(LOGIN1, LOGIN1_PATH)
+        fd = manager.Inhibit('sleep', 'Keyboard backlight', 'Pause keyboard updates', 'delay',
+                             dbus_interface=LOGIN1_MANAGER)
+        sleep_inhibitor = fd.take()
+    except dbus.exceptions.DBusException:
+        print "Can't take sleep inhibitor lock, suspend won't wait for keyboard updates!"
+
+
+def release_sleep_inhibitor():
+    global sleep_inhibitor
+    if sleep_inhibitor is not None:
+        os.close(sleep_inhibitor)
+        sleep_inhibitor = None
+
+
+def sleep_signal_handler(start):
+    metrics.inc('dbus_signals', signal='sleep')
+    if start:
+        on_prepare_for_sleep(True)
+        # service is paused, suspend may go on
+        release_sleep_inhibitor()
+    else:
+        # lock for next suspend
+        _take_sleep_inhibitor()
+        on_prepare_for_sleep(False)
+
+
+def _get_idle_hint():
+    if session is None:
+        return False
+    return bool(session.Get('org.freedesktop.login1.Session', 'IdleHint', dbus_interface=PROPERTIES))
+
+
+def seat_signal_handler(interface, changed, invalidated):
+    metrics.inc('dbus_signals', signal='seat')
+    if 'ActiveSession' in changed:
+        session_path = changed['ActiveSession'][1]
+    elif 'ActiveSession' in invalidated:
+        session_path = seat.Get('org.freedesktop.login1.Seat', 'ActiveSession', dbus_interface=PROPERTIES)[1]
+    else:
+        return
+    if session_path != (session.object_path if session is not None else '/'):
+        # session switch, new session may already be idle
+        _watch_session(session_path)
+        on_idle_changed(_get_idle_hint())
+
+
+def session_signal_handler(interface, changed, invalidated):
+    metrics.inc('dbus_signals', signal='session')
+    # changed value comes with signal, no need to ask for it
+    if 'IdleHint' in changed:
+        on_idle_changed(bool(changed['IdleHint']))
+    elif 'IdleHint' in invalidated:
+        on_idle_changed(_get_idle_hint())
+
+
+class CompositorService(dbus.service.Object):
+    """ D-Bus front end of compositor, every client owns the layers it submits """
+
+    max_client_layers = 16
+
+    def __init__(self, bus, compositor, on_change, clock):
+        dbus.service.Object.__init__(self, bus, COMPOSITOR_PATH)
+        self.compositor = compositor
+        self.on_change = on_change
+        self.clock = clock
+        self.client_watches = {}
+
+    @dbus.service.method(COMPOSITOR_INTERFACE, in_signature='sia{ss}id', out_signature='', sender_keyword='sender')
+    def SubmitLayer(self, name, priority, colors, brightness, ttl, sender=None):
+        """ colors maps left/center/right to a color name, brightness -1 and ttl 0 leave them unset """
+        frame = Frame(brightness=int(brightness) if brightness >= 0 else None)
+        for section, color in colors.items():
+            if section not in Frame.sections or color not in Keyboard.colors_code:
+                raise dbus.exceptions.DBusException("Invalid color {} for section {}".format(color, section))
+            frame.set_color(str(section), str(color))
+        if frame.brightness is not None and frame.brightness > Keyboard.brightness_max:
+            raise dbus.exceptions.DBusException("Invalid brightness {}".format(brightness))
+        if (sender, name) not in self.compositor.layers and \
+                len([key for key in self.compositor.layers if key[0] == sender]) >= self.max_client_layers:
+            raise dbus.exceptions.DBusException("Too many layers")
+
+        self._watch_client(sender)
+        self.compositor.submit(sender, str(name), int(priority), frame, float(ttl), self.clock())
+        metrics.inc('dbus_calls', method='SubmitLayer')
+        self.on_change()
+
+    @dbus.service.method(COMPOSITOR_INTERFACE, in_signature='s', out_signature='b', sender_keyword='sender')
+    def RemoveLayer(self, name, sender=None):
+        removed = self.compositor.remove(sender, str(name))
+        if removed:
+            self.on_change()
+        return removed
+
+    def _watch_client(self, sender):
+        if sender in self.client_watches:
+            return
+
+        # layers go away with the client that submitted them
+        def owner_changed(owner):
+            if not owner:
+                self.client_watches.pop(sender).cancel()
+                self.compositor.remove_client(sender)
+                self.on_change()
+
+        self.client_watches[sender] = self.connection.watch_name_owner(sender, owner_changed)
+
+
+def register_compositor_service(compositor, on_change, clock):
+    global compositor_name, compositor_service
+
+    compositor_name = dbus.service.BusName(COMPOSITOR_NAME, dbus.SystemBus())
+    compositor_service = CompositorService(compositor_name, compositor, on_change, clock)
+
+
+def unregister_compositor_service():
+    compositor_service.remove_from_connection()
 
 
 if __name__ == "__main__":
-    import ConfigParser
-    import TuxedoWmi
-    from dbus.mainloop.glib import (DBusGMainLoop, threads_init)
+    from dbus.mainloop.glib import DBusGMainLoop
     DBusGMainLoop(set_as_default=True)
     import gobject
+
+    def print_idle_hint(idle):
+        print "IdleHint: {}".format(idle)
+
     try:
         loop = gobject.MainLoop()
-        config = ConfigParser.ConfigParser()
-        config.readfp(open('kb_light_stats.conf', 'r'))
-        kb_driver = TuxedoWmi.Keyboard("/sys/module/tuxedo_wmi/parameters/")
-        register_signal_watch(loop, config, kb_driver)
+        register_signal_watch(print_idle_hint)
+        loop.run()
     except KeyboardInterrupt:
         unregister_signal_watch()
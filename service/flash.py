@@ -0,0 +1,95 @@
+__author__ = 'ejcosta'
+
+import sys
+import time
+import socket
+from TuxedoWmi import (
+    Keyboard,
+    Frame,
+)
+
+NOTIFICATIONS_MATCH = "type='method_call',interface='org.freedesktop.Notifications',member='Notify'"
+# socket is open to every local user, requests are kept short and cheap
+MAX_COUNT = 10
+MAX_REQUEST_LENGTH = 256
+
+
+def parse_request(line):
+    """ Parses "<zone|all> <color> [count] [timestamp]" sent to flash socket """
+    fields = line.split()
+    if len(fields) < 2 or len(fields) > 4:
+        raise ValueError("Invalid flash request '{}'".format(line))
+    sections = Frame.sections if fields[0] == 'all' else (fields[0],)
+    if sections[0] not in Frame.sections or fields[1] not in Keyboard.colors_code:
+        raise ValueError("Invalid zone or color in flash request '{}'".format(line))
+    count = int(fields[2]) if len(fields) > 2 else None
+    if count is not None and not 1 <= count <= MAX_COUNT:
+        raise ValueError("Flash count out of 1..{} range in flash request '{}'".format(MAX_COUNT, line))
+    # senders may stamp when event reached them, so latency covers the whole path
+    timestamp = float(fields[3]) if len(fields) > 3 else None
+    return sections, fields[1], count, timestamp
+
+
+def flash_sequence(sections, color, count, period, brightness=None):
+    """ Offsets (in seconds) and layer frames of a flash, None drops layer so underlying frame shows again """
+    frame = Frame(dict((section, color) for section in sections), brightness)
+    steps = []
+    for i in range(count):
+        steps.append((i * period, frame))
+        steps.append((i * period + period / 2.0, None))
+    return steps
+
+
+def watch_notifications(socket_path, zone='all', color='white', critical_color='red', count=3):
+    """ Forwards desktop notifications of the session bus to service flash socket """
+    import dbus
+    import gobject
+    from dbus.mainloop.glib import DBusGMainLoop
+    DBusGMainLoop(set_as_default=True)
+
+    # Service runs as root and can't join user session bus, so this runs inside the session
+    # and keeps one connection to service open, nothing is set up once a notification arrives
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(socket_path)
+
+    def on_message(connection, message):
+        if message.get_member() != 'Notify':
+            return
+        args = message.get_args_list()
+        # urgency hint: 0 low, 1 normal, 2 critical
+        critical = len(args) > 6 and int(args[6].get('urgency', 1)) == 2
+        sock.sendall("{} {} {} {!r}\n".format(zone, critical_color if critical else color, count,
+                                              time.time()).encode('ascii'))
+
+    # a monitor connection sees Notify calls made by every application without being their destination
+    bus = dbus.bus.BusConnection(dbus.bus.BUS_SESSION)
+    bus.call_blocking('org.freedesktop.DBus', '/org/freedesktop/DBus', 'org.freedesktop.DBus.Monitoring',
+                      'BecomeMonitor', 'asu', ([NOTIFICATIONS_MATCH], 0))
+    bus.add_message_filter(on_message)
+    try:
+        gobject.MainLoop().run()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        sock.close()
+
+
+def send(socket_path, request):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(socket_path)
+    sock.sendall("{}\n".format(request).encode('ascii'))
+    sock.close()
+
+
+if __name__ == "__main__":
+    # flash.py <socket> watch [zone] [color] [critical color]
+    # flash.py <socket> <zone|all> <color> [count]
+    if len(sys.argv) < 3:
+        print("Usage: {0} <socket> watch [zone] [color] [critical color]\n"
+              "       {0} <socket> <zone|all> <color> [count]".format(sys.argv[0]))
+    elif sys.argv[2] == 'watch':
+        watch_notifications(sys.argv[1], *sys.argv[3:6])
+    else:
+        fields = sys.argv[2:5] + ['3'] * (len(sys.argv) < 5)
+        parse_request(' '.join(fields))
+        send(sys.argv[1], ' '.join(fields))
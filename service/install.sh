@@ -8,6 +8,7 @@ if [ ! -d "$INSTALL_DIR" ]; then
 fi
 cp -v ./kb_light_stats.conf $INSTALL_DIR/kb_light_stats.conf.template
 cp -v ./kb_light_stats.service /lib/systemd/system/
+cp -v ./org.clevo.KeyboardBacklight.conf /etc/dbus-1/system.d/
 cp -v ./*.py $INSTALL_DIR/
 
 if [ ! -d "$INSTALL_DIR/stats" ]; then
@@ -10,6 +10,7 @@ from lockfile import pidlockfile
 from service_handler import (
     initial_program_setup,
     do_main_program,
+    program_terminate,
     program_cleanup,
     )
 
@@ -20,13 +21,16 @@ context = daemon.DaemonContext(
     pidfile=pidfile,
     )
 
-context.signal_map = {signal.SIGTERM: program_cleanup}
+context.signal_map = {signal.SIGTERM: program_terminate}
 context.gid = grp.getgrnam('root').gr_gid
 
 config_file = open("/etc/{0}/{0}.conf".format(__service_name__), 'r')
 context.files_preserve = [config_file]
 
-initial_program_setup(config_file)
-
 with context:
-    do_main_program()
\ No newline at end of file
+    # setup runs inside daemon context so keyboard parameter files it keeps open survive daemonization
+    initial_program_setup(config_file)
+    try:
+        do_main_program()
+    finally:
+        program_cleanup()
\ No newline at end of file
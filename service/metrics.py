@@ -0,0 +1,148 @@
+__author__ = 'ejcosta'
+
+import os
+import socket
+import time
+from contextlib import contextmanager
+
+# Service self counters, kept as plain numbers so updating them costs next to nothing
+counters = {}
+gauges = {}
+# summaries hold [sum, count, max] per series
+summaries = {}
+# called before metrics are exported, so values owned by other objects can be copied in
+collectors = []
+
+prefix = 'kb_light_stats_'
+
+
+def _series(name, labels):
+    if not labels:
+        return name
+    return '{}{{{}}}'.format(name, ','.join('{}="{}"'.format(k, labels[k]) for k in sorted(labels)))
+
+
+def inc(name, value=1, **labels):
+    series = _series(name, labels)
+    counters[series] = counters.get(series, 0) + value
+
+
+def set_counter(name, value, **labels):
+    # for counts kept by other objects, copied in by collectors
+    counters[_series(name, labels)] = value
+
+
+def set_gauge(name, value, **labels):
+    gauges[_series(name, labels)] = value
+
+
+def get(name, **labels):
+    series = _series(name, labels)
+    return counters.get(series, gauges.get(series, 0))
+
+
+def summary(name, **labels):
+    """ Returns [sum, count, max] of an observed series """
+    return summaries.get(_series(name, labels), [0.0, 0, 0.0])
+
+
+def observe(name, value, **labels):
+    summary = summaries.setdefault(_series(name, labels), [0.0, 0, 0.0])
+    summary[0] += value
+    summary[1] += 1
+    summary[2] = max(summary[2], value)
+
+
+@contextmanager
+def timed(name, **labels):
+    start = time.time()
+    try:
+        yield
+    finally:
+        observe(name, time.time() - start, **labels)
+
+
+def collect():
+    for collector in collectors:
+        collector()
+
+
+def report():
+    collect()
+    lines = ["{}: {}".format(series, value) for series, value in list(counters.items()) + list(gauges.items())]
+    lines += ["{}: {:.6f}s avg over {}".format(series, s[0] / s[1], s[1]) for series, s in summaries.items() if s[1]]
+    return "\n".join(sorted(lines))
+
+
+def exposition():
+    """ Metrics in Prometheus text format """
+    collect()
+    lines = []
+    typed = {}
+
+    def add(name, kind, series, value):
+        if typed.get(name) is None:
+            typed[name] = kind
+            lines.append('# TYPE {}{} {}'.format(prefix, name, kind))
+        lines.append('{}{} {}'.format(prefix, series, value))
+
+    for series in sorted(counters):
+        name, _, labels = series.partition('{')
+        add(name + '_total', 'counter', name + '_total' + (labels and '{' + labels), counters[series])
+    for series in sorted(gauges):
+        add(series.partition('{')[0], 'gauge', series, gauges[series])
+    # series of one metric have to stay together
+    for name in sorted(set(series.partition('{')[0] for series in summaries)):
+        family = [(series.partition('{')[2], summaries[series]) for series in sorted(summaries)
+                  if series.partition('{')[0] == name]
+        for labels, summary in family:
+            labels = labels and '{' + labels
+            add(name, 'summary', name + '_sum' + labels, repr(summary[0]))
+            lines.append('{}{}_count{} {}'.format(prefix, name, labels, summary[1]))
+        for labels, summary in family:
+            labels = labels and '{' + labels
+            add(name + '_max', 'gauge', name + '_max' + labels, repr(summary[2]))
+    return '\n'.join(lines) + '\n'
+
+
+def write_textfile(path):
+    # written aside and renamed, so textfile collector never reads half a file
+    tmp = '{}.{}.tmp'.format(path, os.getpid())
+    with open(tmp, 'w') as f:
+        f.write(exposition())
+    os.rename(tmp, path)
+
+
+def open_socket(path):
+    if os.path.exists(path):
+        os.unlink(path)
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.bind(path)
+    sock.listen(4)
+    sock.setblocking(False)
+    return sock
+
+
+def serve(sock):
+    """ Answers one pending connection with current metrics """
+    try:
+        conn, _ = sock.accept()
+    except socket.error:
+        return
+    # runs on main loop, a client that doesn't read is dropped instead of holding everything else back
+    try:
+        conn.setblocking(False)
+        data = exposition().encode('ascii')
+        while data:
+            data = data[conn.send(data):]
+    except socket.error:
+        inc('metrics_clients_dropped')
+    finally:
+        conn.close()
+
+
+if __name__ == "__main__":
+    inc('frames_computed')
+    observe('sampler_duration_seconds', 0.002, source='cpu')
+    set_gauge('layers', 1)
+    print(exposition())
@@ -0,0 +1,67 @@
+__author__ = 'ejcosta'
+
+import os
+import socket
+
+POWER_SUPPLY_LOCATION = '/sys/class/power_supply/'
+NETLINK_KOBJECT_UEVENT = 15
+
+
+def _read(path):
+    try:
+        with open(path) as f:
+            return f.read().strip()
+    except (OSError, IOError):
+        return None
+
+
+def on_ac_power(location=POWER_SUPPLY_LOCATION):
+    """ True when a mains (or usb) supply is online, or when there is no battery to run from """
+    try:
+        supplies = os.listdir(location)
+    except OSError:
+        return True
+    on_battery = False
+    for supply in supplies:
+        kind = _read(os.path.join(location, supply, 'type'))
+        if kind in ('Mains', 'USB') and _read(os.path.join(location, supply, 'online')) == '1':
+            return True
+        if kind == 'Battery' and _read(os.path.join(location, supply, 'status')) == 'Discharging':
+            on_battery = True
+    return not on_battery
+
+
+class PowerSupplyMonitor(object):
+    """ Kernel uevents socket, readable whenever a device changes state """
+
+    def __init__(self):
+        self.sock = socket.socket(socket.AF_NETLINK, socket.SOCK_DGRAM, NETLINK_KOBJECT_UEVENT)
+        # group 1 carries kernel uevents, same ones udev listens to
+        self.sock.bind((0, 1))
+        self.sock.setblocking(False)
+
+    def fileno(self):
+        return self.sock.fileno()
+
+    def changed(self):
+        """ Drains pending uevents, returns whether any of them came from a power supply """
+        changed = False
+        while True:
+            try:
+                event = self.sock.recv(8192)
+            except socket.error:
+                return changed
+            # action@devpath followed by KEY=value fields, NUL separated
+            if b'\0SUBSYSTEM=power_supply\0' in event:
+                changed = True
+
+    def close(self):
+        self.sock.close()
+
+
+def print_power_source():
+    print("Power source: {}".format("AC" if on_ac_power() else "Battery"))
+
+
+if __name__ == "__main__":
+    print_power_source()
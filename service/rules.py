@@ -0,0 +1,154 @@
+__author__ = 'ejcosta'
+
+import re
+from TuxedoWmi import (
+    Keyboard,
+    Frame,
+)
+from TuxedoWmi.utils import get_option
+
+# metrics a rule may refer to, pressure ones come from stall information
+utilization_metrics = ('cpu', 'memory', 'gpu')
+pressure_metrics = ('cpu_pressure', 'memory_pressure', 'io_pressure')
+# percent of critical temperature and of fan maximum speed, from hwmon and thermal sensors
+sensor_metrics = ('temperature', 'fan')
+# busiest disk utilization, disk and network throughput in percent of configured maximum
+io_metrics = ('disk', 'disk_throughput', 'network')
+metric_names = utilization_metrics + pressure_metrics + sensor_metrics + io_metrics
+
+combinators = {
+    'max': max,
+    'min': min,
+    'avg': lambda *values: sum(values) / float(len(values)),
+}
+
+_token = re.compile(r'\s*(?:([a-z_]+)|(\()|(\))|(,))')
+
+
+class RuleError(Exception):
+    pass
+
+
+def parse_expression(text):
+    """ Compiles "max(cpu, avg(memory, gpu))" into a function of samples and the set of metrics it reads """
+    tokens = []
+    pos = 0
+    text = text.strip()
+    while pos < len(text):
+        match = _token.match(text, pos)
+        if not match:
+            raise RuleError("Unexpected '{}' in '{}'".format(text[pos:], text))
+        tokens.append(match.group(match.lastindex))
+        pos = match.end()
+
+    def parse(i):
+        name = tokens[i] if i < len(tokens) else None
+        if name in combinators:
+            if tokens[i + 1:i + 2] != ['(']:
+                raise RuleError("Expected '(' after {} in '{}'".format(name, text))
+            args, metrics = [], set()
+            i += 2
+            while True:
+                arg, arg_metrics, i = parse(i)
+                args.append(arg)
+                metrics |= arg_metrics
+                if tokens[i:i + 1] == [')']:
+                    break
+                if tokens[i:i + 1] != [',']:
+                    raise RuleError("Expected ',' or ')' in '{}'".format(text))
+                i += 1
+            combine = combinators[name]
+            return (lambda samples: combine(*[arg(samples) for arg in args])), metrics, i + 1
+        if name in metric_names:
+            return (lambda samples: samples[name]), set([name]), i + 1
+        raise RuleError("Unknown metric {} in '{}'".format(name, text))
+
+    evaluate, metrics, end = parse(0)
+    if end != len(tokens):
+        raise RuleError("Unexpected '{}' in '{}'".format(''.join(tokens[end:]), text))
+    return evaluate, metrics
+
+
+def parse_ramp(text):
+    """ Parses "green 40 yellow 60 red" into thresholds and the colors between them """
+    tokens = text.split()
+    try:
+        colors, thresholds = tokens[0::2], [float(t) for t in tokens[1::2]]
+    except ValueError:
+        raise RuleError("Invalid threshold in color ramp '{}'".format(text))
+    if len(colors) != len(thresholds) + 1 or thresholds != sorted(thresholds):
+        raise RuleError("Invalid color ramp '{}'".format(text))
+    for color in colors:
+        if color not in Keyboard.colors_code:
+            raise RuleError("Unknown color {} in ramp '{}'".format(color, text))
+    return thresholds, tuple(colors)
+
+
+class Rule(object):
+
+    def __init__(self, zone, name, evaluate, metrics, color_filter):
+        self.zone = zone
+        self.name = name
+        self.evaluate = evaluate
+        self.metrics = metrics
+        self.filter = color_filter
+        # rules only fed by stall triggers don't need polling
+        self.polled = bool(metrics - set(pressure_metrics))
+
+
+class Plan(object):
+    """ Rules compiled from config and the metrics they need sampled on each tick """
+
+    def __init__(self, rules):
+        self.rules = rules
+        self.metrics = set()
+        for rule in rules:
+            self.metrics |= rule.metrics
+        self.polled = any(rule.polled for rule in rules)
+
+    def pressure_resources(self):
+        return sorted(metric[:-len('_pressure')] for metric in self.metrics if metric in pressure_metrics)
+
+    def evaluate(self, samples, now=None):
+        frame = Frame()
+        for rule in self.rules:
+            frame.set_color(rule.zone, rule.filter.update(rule.evaluate(samples), now))
+        return frame
+
+
+def compile_rules(config, make_filter, pressure=True):
+    """ Builds a plan from [rules], or from [stats] zones when no rules are configured """
+    default_ramp = 'green {} yellow {} red'.format(get_option(config, 'thresholds', 'green', 40),
+                                                   get_option(config, 'thresholds', 'yellow', 60))
+    pressure_ramp = 'green {} yellow {} red'.format(get_option(config, 'pressure', 'green', 10),
+                                                    get_option(config, 'pressure', 'yellow', 40))
+
+    definitions = [(zone, config.get('rules', zone)) for zone in Frame.sections
+                   if config.has_option('rules', zone)]
+    if not definitions:
+        stall = pressure and get_option(config, 'stats', 'source', 'utilization') == 'pressure'
+        definitions = []
+        for stat in ('cpu', 'memory', 'gpu', 'io', 'temperature', 'fan', 'disk', 'disk_throughput', 'network'):
+            zone = get_option(config, 'stats', stat, '')
+            if zone not in Frame.sections:
+                continue
+            if stall and stat in ('cpu', 'memory', 'io'):
+                definitions.append((zone, '{}_pressure : {}'.format(stat, pressure_ramp)))
+            elif stat != 'io':
+                definitions.append((zone, stat))
+
+    rules = []
+    for zone, definition in definitions:
+        expression, _, ramp = definition.partition(':')
+        evaluate, metrics = parse_expression(expression)
+        if not pressure and metrics & set(pressure_metrics):
+            print "Rule for {} zone needs pressure stall information, skipping it!".format(zone)
+            continue
+        if not ramp.strip():
+            only_pressure = not (metrics - set(pressure_metrics))
+            ramp = pressure_ramp if only_pressure else default_ramp
+        thresholds, colors = parse_ramp(ramp)
+        # single metric rules keep stat name, so per stat smoothing options still apply
+        name = expression.strip() if len(metrics) == 1 and expression.strip() in metrics else zone
+        rules.append(Rule(zone, name, evaluate, metrics, make_filter(name.replace('_pressure', ''), thresholds, colors)))
+    return Plan(rules)
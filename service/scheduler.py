@@ -0,0 +1,92 @@
+__author__ = 'ejcosta'
+
+import os
+import time
+
+CLOCK_MONOTONIC = 1
+
+
+def _monotonic_clock():
+    """ Clock that never jumps with wall clock (NTP, date changes), python 2 time module has none """
+    if hasattr(time, 'monotonic'):
+        return time.monotonic
+    try:
+        import ctypes
+        import ctypes.util
+
+        class timespec(ctypes.Structure):
+            _fields_ = [('tv_sec', ctypes.c_long), ('tv_nsec', ctypes.c_long)]
+
+        libc = ctypes.CDLL(ctypes.util.find_library('c') or 'libc.so.6', use_errno=True)
+        clock_gettime = libc.clock_gettime
+        clock_gettime.argtypes = [ctypes.c_int, ctypes.POINTER(timespec)]
+        ts = timespec()
+
+        def monotonic():
+            if clock_gettime(CLOCK_MONOTONIC, ctypes.byref(ts)):
+                errno = ctypes.get_errno()
+                raise OSError(errno, os.strerror(errno))
+            return ts.tv_sec + ts.tv_nsec * 1e-9
+        monotonic()
+        return monotonic
+    except (OSError, AttributeError):
+        print "No monotonic clock available, deadlines follow wall clock!"
+        return time.time
+
+
+clock = _monotonic_clock()
+
+
+class AdaptiveScheduler(object):
+    """ Hands out absolute sampling deadlines, fast while stats move and backing off while they are steady """
+
+    def __init__(self, min_interval, max_interval, backoff=2.0):
+        self.min_interval = float(min_interval)
+        self.max_interval = max(float(max_interval), self.min_interval)
+        self.backoff = float(backoff)
+        self.reset()
+
+    def reset(self):
+        self.interval = self.min_interval
+        self.deadline = None
+
+    def next(self, settled):
+        if settled:
+            self.interval = min(self.interval * self.backoff, self.max_interval)
+        else:
+            self.interval = self.min_interval
+
+        now = clock()
+        # Deadlines follow each other so sampling time doesn't add drift, unless the clock jumped
+        if self.deadline is None or abs(now - self.deadline) > self.max_interval:
+            self.deadline = now
+        self.deadline += self.interval
+        # ticks missed while busy are skipped instead of run back to back
+        while self.deadline <= now:
+            self.deadline += self.interval
+        return self.deadline
+
+
+class TokenBucket(object):
+    """ Allows rate operations per second on average, in bursts of up to burst operations """
+
+    def __init__(self, rate, burst=None):
+        self.rate = float(rate)
+        self.burst = float(self.rate if burst is None else burst)
+        self.tokens = self.burst
+        self.last = None
+
+    def take(self, count, now):
+        if self.last is not None:
+            self.tokens = min(self.tokens + (now - self.last) * self.rate, self.burst)
+        self.last = now
+        if count > self.tokens:
+            return False
+        self.tokens -= count
+        return True
+
+
+if __name__ == "__main__":
+    scheduler = AdaptiveScheduler(2, 30)
+    for settled in (True, True, True, True, True, False):
+        print("settled: {} next interval: {}".format(settled, scheduler.next(settled) and scheduler.interval))
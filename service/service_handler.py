@@ -1,26 +1,41 @@
 __author__ = 'ejcosta'
 
 import time
+# taken before heavy imports, so start up time reported includes them
+program_start = time.time()
+
+import os
+import socket
 import ConfigParser
 import TuxedoWmi
-import threading
-from dbus_handler import (
-    register_signal_watch,
-    unregister_signal_watch,
+import flash
+import metrics
+import power
+import rules
+from compositor import Compositor
+from scheduler import (
+    AdaptiveScheduler,
+    TokenBucket,
+    clock,
 )
-from stats import (
-    cpu,
-    memory,
-    gpu
+from stats import pressure
+from TuxedoWmi.utils import (
+    ColorFilter,
+    Fade,
+    get_option,
+    get_boolean_option,
 )
-from TuxedoWmi.utils import percent_to_kb_color
-from dbus.mainloop.glib import DBusGMainLoop
-DBusGMainLoop(set_as_default=True)
 import gobject
 
 
 def initial_program_setup(config_file):
-    global config, kb_driver, polling_interval, thresholds, def_color
+    global config, kb_driver, polling_interval, max_polling_interval, settle_margin, def_color, plan, samplers, \
+        pressure_monitor, thermal_monitor, disk_stats, network_stats, compositor, compositor_enabled, frame_interval, stats_priority, dim_priority, \
+        metrics_textfile, metrics_textfile_interval, metrics_socket, state_file, saved_state, first_frame, \
+        audio_enabled, audio_block, audio_priority, audio_filters, audio_budget, \
+        flash_socket, flash_socket_mode, flash_count, flash_period, flash_priority, \
+        power_enabled, power_location, power_profiles, backend_options, backend_workers, \
+        ambient_light, ambient_filter, ambient_percent, ambient_interval, ambient_priority
 
     # Load config
     config = ConfigParser.ConfigParser()
@@ -32,58 +47,882 @@ def initial_program_setup(config_file):
     # Load polling interval used to sleep during main cycle
     polling_interval = config.get('service', 'polling_interval', 60)
 
-    # Load thresholds used to define colors by percentage
-    thresholds = [int(config.get('thresholds', 'green', 40)), int(config.get('thresholds', 'yellow', 60))]
+    # Load how far polling interval may back off while stats are steady
+    max_polling_interval = float(get_option(config, 'service', 'max_polling_interval', polling_interval))
+    settle_margin = float(get_option(config, 'service', 'settle_margin', 10))
+
+    # Load rules mapping stats to keyboard zones, compiled once into the plan evaluated on every sample
+    plan = rules.compile_rules(config, _make_filter)
+
+    # Stall triggers are registered only for pressure stats rules refer to
+    pressure_monitor = None
+    if plan.pressure_resources():
+        try:
+            pressure_monitor = pressure.PressureMonitor(plan.pressure_resources(),
+                                                        get_option(config, 'pressure', 'trigger_stall', 200),
+                                                        get_option(config, 'pressure', 'trigger_window', 2000))
+        except (OSError, IOError):
+            print "Pressure stall information unavailable, using utilization stats!"
+            plan = rules.compile_rules(config, _make_filter, pressure=False)
+
+    # Stats that can be sampled, modules behind them (psutil, nvidia-smi) are only loaded when plan needs them
+    samplers = {}
+    if 'cpu' in plan.metrics:
+        from stats import cpu
+        samplers['cpu'] = cpu.get_cpu_load
+    if 'memory' in plan.metrics:
+        from stats import memory
+        samplers['memory'] = memory.get_mem_usage
+    if 'gpu' in plan.metrics:
+        from stats import gpu
+        samplers['gpu'] = gpu.get_gpu_load
+    for resource in plan.pressure_resources():
+        samplers[resource + '_pressure'] = lambda resource=resource: pressure_monitor.get_pressure(resource)
+
+    # Sensors are looked up once, their files stay open and are reread on each sample
+    thermal_monitor = None
+    if plan.metrics & set(rules.sensor_metrics):
+        from stats import thermal
+        try:
+            thermal_monitor = thermal.ThermalMonitor(get_option(config, 'thermal', 'root', '/'),
+                                                     get_option(config, 'thermal', 'sensor', None),
+                                                     get_option(config, 'thermal', 'max_temp', 100),
+                                                     get_option(config, 'thermal', 'max_fan', 5000))
+            samplers['temperature'] = thermal_monitor.get_temperature
+            samplers['fan'] = thermal_monitor.get_fan
+        except (OSError, IOError):
+            print "No temperature sensor found, temperature and fan show as 0!"
+            samplers['temperature'] = samplers['fan'] = lambda: 0
+
+    # I/O counters files stay open, each sample rereads them and turns counters into rates
+    disk_stats = None
+    if plan.metrics & set(['disk', 'disk_throughput']):
+        from stats import disk
+        disk_stats = disk.DiskStats(get_option(config, 'disk', 'devices', disk.DEFAULT_DEVICES),
+                                    get_option(config, 'disk', 'max_throughput', 500))
+        samplers['disk'] = disk_stats.get_utilization
+        samplers['disk_throughput'] = disk_stats.get_throughput
+    network_stats = None
+    if 'network' in plan.metrics:
+        from stats import network
+        network_stats = network.NetworkStats(get_option(config, 'network', 'devices', network.DEFAULT_DEVICES),
+                                             get_option(config, 'network', 'max_throughput', 100))
+        samplers['network'] = network_stats.get_throughput
+
+    # Load ambient light sensor, keyboard brightness follows room light through its own layer
+    ambient_light = None
+    if get_boolean_option(config, 'ambient', 'enabled', False):
+        from stats import light
+        try:
+            ambient_light = light.AmbientLight(get_option(config, 'ambient', 'root', '/'),
+                                               get_option(config, 'ambient', 'device', None),
+                                               get_boolean_option(config, 'ambient', 'buffered', True))
+        except (OSError, IOError):
+            print "No ambient light sensor found, brightness is left as it is!"
+        dark = float(get_option(config, 'ambient', 'dark', 5))
+        bright = float(get_option(config, 'ambient', 'bright', 400))
+        ambient_percent = lambda lux: light.lux_to_percent(lux, dark, bright)
+        # every brightness level is a color of the ramp, so it gets same smoothing, hysteresis and dwell time
+        thresholds, levels = light.brightness_levels(int(get_option(config, 'ambient', 'min_brightness', 1)),
+                                                     int(get_option(config, 'ambient', 'max_brightness',
+                                                                    TuxedoWmi.Keyboard.brightness_max)))
+        ambient_filter = ColorFilter(thresholds,
+                                     alpha=float(get_option(config, 'ambient', 'alpha', 0.5)),
+                                     hysteresis=float(get_option(config, 'ambient', 'hysteresis', 5)),
+                                     min_dwell=float(get_option(config, 'ambient', 'min_dwell', 10)),
+                                     colors=levels)
+    ambient_interval = float(get_option(config, 'ambient', 'interval', 1))
+    ambient_priority = int(get_option(config, 'ambient', 'priority', 10))
 
     # Load default keyboard color
     def_color = config.get('service', 'def_color', 'blue')
 
+    # Load compositor setup, stats and dimming are layers like the ones submitted by other clients over dbus
+    compositor = Compositor()
+    compositor_enabled = get_boolean_option(config, 'compositor', 'enabled', False)
+    frame_interval = float(get_option(config, 'compositor', 'frame_interval', 0.1))
+    stats_priority = int(get_option(config, 'compositor', 'stats_priority', 0))
+    dim_priority = int(get_option(config, 'compositor', 'dim_priority', 100))
+
+    # Load where service exposes its own metrics
+    metrics_textfile = get_option(config, 'metrics', 'textfile', None)
+    metrics_textfile_interval = int(get_option(config, 'metrics', 'textfile_interval', 60))
+    metrics_socket = get_option(config, 'metrics', 'socket', None)
+
+    # Load audio mode, zones follow bass, mid and treble energy of what is playing
+    audio_enabled = get_boolean_option(config, 'audio', 'enabled', False)
+    audio_block = int(get_option(config, 'audio', 'block', 1024))
+    audio_priority = int(get_option(config, 'audio', 'priority', 50))
+    thresholds, colors = rules.parse_ramp(get_option(config, 'audio', 'ramp', 'blue 30 green 60 yellow 85 red'))
+    audio_filters = [ColorFilter(thresholds, hysteresis=float(get_option(config, 'audio', 'hysteresis', 5)),
+                                 colors=colors) for _ in TuxedoWmi.Frame.sections]
+    # every zone write makes driver reprogram colors and brightness (3 to 5 SET_KB_LED calls),
+    # budget keeps them to what controller sustains, as measured by driver loaded with kb_calibrate=1
+    audio_budget = TokenBucket(float(get_option(config, 'audio', 'max_zone_writes', kb_driver.get_zone_rate() or 10)),
+                               len(TuxedoWmi.Frame.sections))
+
+    # Load flash requests socket, notifications and scripts flash zones through it
+    flash_socket = get_option(config, 'flash', 'socket', None)
+    flash_socket_mode = int(str(get_option(config, 'flash', 'socket_mode', '666')), 8)
+    flash_count = int(get_option(config, 'flash', 'count', 3))
+    flash_period = float(get_option(config, 'flash', 'period', 0.3))
+    flash_priority = int(get_option(config, 'flash', 'priority', 200))
+
+    # Load power profiles, each one sets sampling, write rates, brightness cap and modes allowed
+    power_enabled = get_boolean_option(config, 'power', 'enabled', False)
+    power_location = get_option(config, 'power', 'location', power.POWER_SUPPLY_LOCATION)
+    power_profiles = dict((name, _load_power_profile(name)) for name in ('ac', 'battery'))
+
+    # Load extra devices showing same frames as keyboard, each one is driven from its own thread
+    backend_options = [(name, dict(config.items('backend_' + name)))
+                       for name in get_option(config, 'backends', 'names', '').split()]
+    backend_workers = []
+
+    # Load where keyboard state is kept between runs
+    state_file = get_option(config, 'service', 'state_file', None)
+    saved_state = None
+    first_frame = True
+
+
+def _load_power_profile(name):
+    # values missing from profile section keep what rest of config sets
+    section = 'power_' + name
+    return {
+        'polling_interval': float(get_option(config, section, 'polling_interval', polling_interval)),
+        'max_polling_interval': float(get_option(config, section, 'max_polling_interval', max_polling_interval)),
+        'frame_interval': float(get_option(config, section, 'frame_interval', frame_interval)),
+        'max_zone_writes': float(get_option(config, section, 'max_zone_writes', audio_budget.rate)),
+        'brightness_cap': int(get_option(config, section, 'brightness_cap', TuxedoWmi.Keyboard.brightness_max)),
+        'modes': get_option(config, section, 'modes', 'stats audio flash').split(),
+    }
+
+
+def _make_filter(stat, thresholds, colors):
+    # Smoothing, hysteresis and dwell time applied to each stat before it turns into a color
+    return ColorFilter(thresholds,
+                       alpha=_smoothing_option(stat, 'alpha', 1),
+                       hysteresis=_smoothing_option(stat, 'hysteresis', 0),
+                       min_dwell=_smoothing_option(stat, 'min_dwell', 0),
+                       colors=colors)
+
+
+def _smoothing_option(stat, option, default):
+    # per stat value (e.g. cpu_alpha) takes precedence over the shared one
+    return float(get_option(config, 'smoothing', '{}_{}'.format(stat, option),
+                            get_option(config, 'smoothing', option, default)))
+
+
+def init_program_state():
+    global audio_stream, audio_source, flash_source, power_profile, power_modes, power_monitor, scheduler, sample_source, dim_source, fade, session_idle, frame_source, expiry_source, last_frame, system_sleeping, fade_interrupted, ambient_source
+
+    scheduler = AdaptiveScheduler(polling_interval, max_polling_interval)
+    sample_source = None
+    dim_source = None
+    fade = None
+    session_idle = False
+    frame_source = None
+    expiry_source = None
+    last_frame = 0
+    audio_stream = None
+    audio_source = None
+    flash_source = None
+    power_profile = None
+    power_modes = power_profiles['ac']['modes']
+    power_monitor = None
+    system_sleeping = False
+    fade_interrupted = False
+    ambient_source = None
+    compositor.base = kb_driver.get_frame()
+
 
 def do_main_program():
-    global dbus_thread, loop
+    global loop
+
+    # Everything runs on a single main loop: sampling and dimming are timers,
+    # dbus signals and pressure triggers are dispatched by the same loop
+    loop = gobject.MainLoop()
+
+    # Keyboard shows state from last run before anything else is loaded
+    init_program_state()
+    restore_state()
+
+    from dbus.mainloop.glib import DBusGMainLoop
+    DBusGMainLoop(set_as_default=True)
+    import dbus_handler
+
+    # Power off/on keyboard lights on dbus events
+    dbus_handler.register_signal_watch(on_idle_changed)
+    # Nothing is written while system suspends or resumes
+    dbus_handler.register_sleep_watch(on_sleep)
+
+    # Let other tools draw on keyboard through compositor instead of writing to driver
+    if compositor_enabled:
+        dbus_handler.register_compositor_service(compositor, request_frame, clock)
+
+    if pressure_monitor is not None:
+        for fd in pressure_monitor.fds.values():
+            gobject.io_add_watch(fd, gobject.IO_PRI, _on_pressure_trigger)
+    if thermal_monitor is not None:
+        for fd in thermal_monitor.alarm_fds:
+            gobject.io_add_watch(fd, gobject.IO_PRI | gobject.IO_ERR, _on_sensor_alarm)
+
+    # Own metrics, exported on a timer to textfile and on demand to socket clients
+    metrics.collectors.append(_collect_keyboard_metrics)
+    if metrics_textfile:
+        gobject.timeout_add_seconds(metrics_textfile_interval, _write_metrics_textfile)
+    if metrics_socket:
+        sock = metrics.open_socket(metrics_socket)
+        gobject.io_add_watch(sock.fileno(), gobject.IO_IN, _serve_metrics, sock)
 
-    # Based on documentation:
-    # This must be called before creating a second thread in a program that uses this module.
+    if power_enabled:
+        _start_power_governor()
+    if audio_enabled and 'audio' in power_modes and audio_stream is None:
+        _start_audio()
+
+    if backend_options:
+        _start_backends()
+
+    if ambient_light is not None:
+        _start_ambient()
+
+    if flash_socket:
+        flash_listener = metrics.open_socket(flash_socket)
+        os.chmod(flash_socket, flash_socket_mode)
+        gobject.io_add_watch(flash_listener.fileno(), gobject.IO_IN, _on_flash_connection, flash_listener)
+
+    _schedule_sample(clock())
+    try:
+        loop.run()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        _stop_audio()
+        if power_monitor is not None:
+            power_monitor.close()
+        if ambient_light is not None:
+            ambient_light.close()
+        dbus_handler.unregister_sleep_watch()
+        dbus_handler.unregister_signal_watch()
+        if compositor_enabled:
+            dbus_handler.unregister_compositor_service()
+        if metrics_socket:
+            sock.close()
+            os.unlink(metrics_socket)
+        if flash_socket:
+            flash_listener.close()
+            os.unlink(flash_socket)
+
+
+def program_terminate(signum, frame):
+    loop.quit()
+
+
+def program_cleanup():
+    if state_file:
+        # keyboard keeps its colors, next run picks up from them
+        save_state()
+    else:
+        commit_frame(TuxedoWmi.Frame({'left': def_color, 'center': def_color, 'right': def_color}))
+    # last frame reaches every device before service goes away
+    for worker in backend_workers:
+        worker.close()
+    if metrics_textfile:
+        metrics.write_textfile(metrics_textfile)
+    print metrics.report()
+
+
+def _collect_keyboard_metrics():
+    metrics.counters['sysfs_reads'] = kb_driver.reads
+    metrics.counters['sysfs_writes'] = kb_driver.writes
+    for worker in backend_workers:
+        name = worker.backend.name
+        metrics.set_counter('backend_frames_committed', worker.committed, backend=name)
+        metrics.set_counter('backend_frames_dropped', worker.dropped, backend=name)
+        metrics.set_counter('backend_errors', worker.errors, backend=name)
+        metrics.set_counter('backend_writes', worker.backend.writes, backend=name)
+        metrics.set_counter('backend_busy_seconds', worker.busy_seconds, backend=name)
+    if power_profile is not None:
+        _account_power_profile()
+
+
+def _start_backends():
+    # worker threads only get to run while main loop waits if gobject releases the interpreter lock
     gobject.threads_init()
+    for name, options in backend_options:
+        try:
+            backend_workers.append(TuxedoWmi.BackendWorker(TuxedoWmi.make_backend(name, options)))
+        except (OSError, IOError, KeyError, ValueError) as e:
+            print "Can't open {} backend, leaving it out: {}".format(name, e)
+    # devices start from what keyboard shows
+    _commit_now()
+
+
+def _start_power_governor():
+    global power_monitor
+    try:
+        power_monitor = power.PowerSupplyMonitor()
+        gobject.io_add_watch(power_monitor.fileno(), gobject.IO_IN, _on_power_event)
+    except socket.error:
+        # no uevents (e.g. in a container), power source is checked once a minute instead
+        gobject.timeout_add_seconds(60, _on_power_event)
+    _apply_power_profile('ac' if power.on_ac_power(power_location) else 'battery')
+
+
+def _on_power_event(*args):
+    if power_monitor is None or power_monitor.changed():
+        _apply_power_profile('ac' if power.on_ac_power(power_location) else 'battery')
+    return True
+
+
+def _apply_power_profile(name):
+    """ Switches every setting profile holds and writes resulting frame with a single commit """
+    global power_profile, power_modes, frame_interval, power_accounted
+    if name == power_profile:
+        return
+    if power_profile is not None:
+        _account_power_profile()
+    print "Switching to {} power profile".format(name)
+    metrics.inc('power_profile_switches', profile=name)
+    power_profile = name
+    power_accounted = (clock(), metrics.get('wakeups'), kb_driver.writes)
+    profile = power_profiles[name]
+
+    scheduler.min_interval = profile['polling_interval']
+    scheduler.max_interval = max(profile['max_polling_interval'], profile['polling_interval'])
+    frame_interval = profile['frame_interval']
+    audio_budget.rate = profile['max_zone_writes']
+    compositor.brightness_cap = profile['brightness_cap']
+
+    power_modes = profile['modes']
+    if system_sleeping:
+        # nothing runs or writes while suspended, resume starts what this profile runs
+        if 'stats' not in power_modes:
+            compositor.remove(None, 'stats')
+        return
+    if audio_enabled and 'audio' in power_modes:
+        if audio_stream is None:
+            _start_audio()
+    else:
+        _stop_audio()
+    if 'stats' in power_modes:
+        scheduler.reset()
+        _schedule_sample(clock())
+    else:
+        _cancel_sample()
+        compositor.remove(None, 'stats')
+    _commit_now()
+
+
+def _account_power_profile():
+    # time, sampling wakeups and hardware writes spent under current profile
+    global power_accounted
+    now, wakeups, writes = clock(), metrics.get('wakeups'), kb_driver.writes
+    since, since_wakeups, since_writes = power_accounted
+    metrics.inc('power_profile_seconds', now - since, profile=power_profile)
+    metrics.inc('power_profile_wakeups', wakeups - since_wakeups, profile=power_profile)
+    metrics.inc('power_profile_writes', writes - since_writes, profile=power_profile)
+    power_accounted = (now, wakeups, writes)
+    # per hour rates make profiles comparable, their difference is what battery profile saves
+    for name in power_profiles:
+        seconds = metrics.get('power_profile_seconds', profile=name)
+        if seconds:
+            metrics.set_gauge('power_profile_wakeups_per_hour',
+                              metrics.get('power_profile_wakeups', profile=name) * 3600 / seconds, profile=name)
+            metrics.set_gauge('power_profile_writes_per_hour',
+                              metrics.get('power_profile_writes', profile=name) * 3600 / seconds, profile=name)
+
+
+def _write_metrics_textfile():
+    metrics.write_textfile(metrics_textfile)
+    return True
+
+
+def _serve_metrics(fd, condition, sock):
+    metrics.serve(sock)
+    return True
+
+
+def _schedule_sample(deadline):
+    global sample_source
+    _cancel_sample()
+    if system_sleeping or 'stats' not in power_modes:
+        return
+    sample_source = gobject.timeout_add(int(max(deadline - clock(), 0) * 1000), _sample)
+
+
+def _cancel_sample():
+    global sample_source
+    if sample_source is not None:
+        gobject.source_remove(sample_source)
+        sample_source = None
 
-    # Init dbus main loop
-    loop = gobject.MainLoop()
 
-    # Create and start thread responsible for power off/on keyboard lights on dbus events
-    dbus_thread = threading.Thread(target=register_signal_watch, args=(loop, config, kb_driver))
-    dbus_thread.daemon = True
-    dbus_thread.start()
+def _sample():
+    with metrics.timed('loop_iteration_seconds', callback='sample'):
+        return _sample_once()
 
-    # Main cycle
-    while True:
-        update_stats()
+
+def _sample_once():
+    global sample_source
+    sample_source = None
+    metrics.inc('wakeups')
+    if session_idle:
+        # nobody is looking at keyboard, sampling resumes on wake up
+        scheduler.reset()
+        return False
+
+    settled = update_stats()
+    if pressure_monitor is not None and settled and not plan.polled:
+        # system is healthy, nothing to do until a stall trigger fires
+        scheduler.reset()
+        return False
+
+    _schedule_sample(scheduler.next(settled))
+    return False
+
+
+def _on_pressure_trigger(fd, condition):
+    if not session_idle:
+        _schedule_sample(clock())
+    return True
+
+
+def _on_sensor_alarm(fd, condition):
+    # alarm raised or cleared, either way readings have just moved
+    thermal_monitor.read_alarm(fd)
+    metrics.inc('sensor_alarms')
+    if not session_idle:
+        _schedule_sample(clock())
+    return True
+
+
+def _start_ambient():
+    global ambient_source
+    # sensors with a trigger push readings through their buffer, others are polled
+    if ambient_light.fileno() is not None:
+        ambient_source = gobject.io_add_watch(ambient_light.fileno(),
+                                              gobject.IO_IN | gobject.IO_ERR | gobject.IO_HUP, _on_ambient_data)
+    else:
+        ambient_source = gobject.timeout_add(int(ambient_interval * 1000), _poll_ambient)
+        _poll_ambient()
+
+
+def _stop_ambient():
+    global ambient_source
+    if ambient_source is not None:
+        gobject.source_remove(ambient_source)
+        ambient_source = None
+
+
+def _on_ambient_data(fd, condition):
+    if condition & (gobject.IO_ERR | gobject.IO_HUP):
+        print "Ambient light buffer went away, polling sensor instead"
+        ambient_light.close_buffer()
+        _start_ambient()
+        return False
+    lux = ambient_light.read_buffer()
+    if lux is not None:
+        _update_ambient(lux)
+    return True
+
+
+def _poll_ambient():
+    try:
+        _update_ambient(ambient_light.read())
+    except (OSError, ValueError) as e:
+        metrics.inc('ambient_errors')
+        print "Can't read ambient light: {}".format(e)
+    return True
+
+
+def _update_ambient(lux):
+    """ Turns a reading into a brightness level, keyboard is only written when level changes """
+    metrics.inc('ambient_samples')
+    metrics.set_gauge('ambient_lux', lux)
+    level = ambient_filter.update(ambient_percent(lux), clock())
+    layer = compositor.layers.get((None, 'ambient'))
+    if layer is not None and layer.frame.brightness == level:
+        return
+    compositor.submit(None, 'ambient', ambient_priority, TuxedoWmi.Frame(brightness=level))
+    metrics.inc('ambient_level_changes')
+    request_frame()
+
+
+def _start_audio():
+    global audio_stream, audio_spectrum, audio_source
+    # numpy is only loaded when audio mode is on
+    from stats import audio
+    try:
+        audio_stream = audio.AudioStream(get_option(config, 'audio', 'source', 'pulse'),
+                                         int(get_option(config, 'audio', 'rate', 44100)),
+                                         get_option(config, 'audio', 'device', '@DEFAULT_MONITOR@'))
+    except Exception:
+        print "Audio source unavailable, audio mode disabled!"
+        return
+    audio_spectrum = audio.AudioSpectrum(audio_stream.rate, audio_block, audio_stream.channels)
+    if audio_stream.paced:
+        # wav stand-in is read one block per block duration, like a live stream
+        audio_source = gobject.timeout_add(audio_block * 1000 // audio_stream.rate, _on_audio)
+    else:
+        audio_source = gobject.io_add_watch(audio_stream.fileno(), gobject.IO_IN | gobject.IO_HUP, _on_audio)
+
+
+def _stop_audio():
+    global audio_stream, audio_source
+    if audio_source is not None:
+        gobject.source_remove(audio_source)
+        audio_source = None
+    if audio_stream is not None:
+        audio_stream.close()
+        audio_stream = None
+    if (None, 'audio') in compositor.layers:
+        # stats show through again
+        compositor.remove(None, 'audio')
+        request_frame()
+
+
+def _on_audio(*args):
+    with metrics.timed('loop_iteration_seconds', callback='audio'):
+        return _read_audio()
+
+
+def _read_audio():
+    global audio_source
+    # live capture is drained, wav stand-in gives one block per tick to play in real time
+    data = audio_stream.read(audio_block if audio_stream.paced else audio_block * 4)
+    if data is None:
+        return True
+    if not data:
+        print "Audio stream ended, audio mode disabled!"
+        audio_source = None
+        _stop_audio()
+        return False
+    levels = audio_spectrum.feed(data)
+    if levels is None:
+        return True
+
+    now = clock()
+    frame = TuxedoWmi.Frame()
+    for section, color_filter, level in zip(TuxedoWmi.Frame.sections, audio_filters, levels):
+        frame.set_color(section, color_filter.update(level, now))
+    layer = compositor.layers.get((None, 'audio'))
+    changes = frame.diff(layer.frame) if layer is not None else frame
+    if changes.is_empty():
+        return True
+    if not audio_budget.take(len(changes.colors), now):
+        # over write budget, keyboard catches up on a later block
+        metrics.inc('audio_frames_dropped')
+        return True
+    compositor.submit(None, 'audio', audio_priority, frame)
+    request_frame()
+    return True
+
+
+def _on_flash_connection(fd, condition, listener):
+    try:
+        conn, _ = listener.accept()
+    except socket.error:
+        return True
+    conn.setblocking(False)
+    # senders may keep connection open and send one request per line
+    gobject.io_add_watch(conn.fileno(), gobject.IO_IN | gobject.IO_HUP, _on_flash_data, conn, [''])
+    return True
+
+
+def _on_flash_data(fd, condition, conn, pending):
+    received = time.time()
+    try:
+        data = conn.recv(4096)
+    except socket.error:
+        return True
+    if not data:
+        conn.close()
+        return False
+    lines = (pending[0] + data.decode('ascii', 'replace')).split('\n')
+    pending[0] = lines.pop()
+    if len(pending[0]) > flash.MAX_REQUEST_LENGTH:
+        print "Flash request too long, connection dropped"
+        conn.close()
+        return False
+    for line in lines:
         try:
-            time.sleep(int(polling_interval))
-        except KeyboardInterrupt:
-            unregister_signal_watch()
-            loop.quit()
-            break
+            sections, color, count, timestamp = flash.parse_request(line)
+        except ValueError as e:
+            print e
+            continue
+        start_flash(sections, color, count or flash_count,
+                    timestamp or received, 'notification' if timestamp else 'socket')
+    return True
 
 
-def program_cleanup():
-    kb_driver.set_colors({'left': def_color, 'center': def_color, 'right': def_color})
+def start_flash(sections, color, count, event_time, source):
+    """ Plays a precomputed flash, committing each step right away instead of waiting for next frame """
+    global flash_source, flash_steps, flash_start
+    if system_sleeping or 'flash' not in power_modes:
+        metrics.inc('flashes_suppressed', source=source)
+        return
+    if flash_source is not None:
+        gobject.source_remove(flash_source)
+        flash_source = None
+    # flash shows at user brightness even while keyboard is dimmed
+    flash_steps = flash.flash_sequence(sections, color, count, flash_period, compositor.base.brightness)
+    flash_start = clock()
+    metrics.inc('flashes', source=source)
+    _flash_step()
+    metrics.observe('flash_latency_seconds', time.time() - event_time, source=source)
+
+
+def _flash_step():
+    global flash_source
+    flash_source = None
+    if not flash_steps:
+        return False
+    offset, frame = flash_steps.pop(0)
+    if frame is None:
+        compositor.remove(None, 'flash')
+    else:
+        compositor.submit(None, 'flash', flash_priority, frame)
+    metrics.observe('flash_step_lag_seconds', max(clock() - flash_start - offset, 0))
+    _commit_now()
+    if flash_steps:
+        flash_source = gobject.timeout_add(int(max(flash_start + flash_steps[0][0] - clock(), 0) * 1000), _flash_step)
+    return False
+
+
+def _commit_now():
+    # bypasses frame coalescing, for changes that can't wait
+    global last_frame
+    if system_sleeping:
+        return
+    last_frame = clock()
+    commit_frame(compositor.compose(last_frame))
+
+
+def request_frame():
+    """ Composes and commits a frame, coalescing requests to at most one frame per frame_interval """
+    global frame_source
+    # while system sleeps, changes wait for the commit made on resume
+    if frame_source is None and not system_sleeping:
+        frame_source = gobject.timeout_add(int(max(last_frame + frame_interval - clock(), 0) * 1000), _compose_frame)
+
+
+def _compose_frame():
+    global frame_source, expiry_source, last_frame
+    frame_source = None
+    last_frame = clock()
+    with metrics.timed('loop_iteration_seconds', callback='frame'):
+        commit_frame(compositor.compose(last_frame))
+    metrics.set_gauge('layers', len(compositor.layers))
+
+    # compose again once next layer runs out of time
+    if expiry_source is not None:
+        gobject.source_remove(expiry_source)
+        expiry_source = None
+    expiry = compositor.next_expiry()
+    if expiry is not None:
+        expiry_source = gobject.timeout_add(int(max(expiry - clock(), 0) * 1000), _on_layer_expired)
+    return False
+
+
+def _on_layer_expired():
+    global expiry_source
+    expiry_source = None
+    request_frame()
+    return False
+
+
+def on_idle_changed(idle):
+    global session_idle
+    if idle == session_idle:
+        return
+    session_idle = idle
+    metrics.inc('idle_transitions', state='dim' if idle else 'wake')
+    if idle:
+        # brightness changed behind our back (e.g. hotkeys) becomes the one restored on wake up
+        kb_driver.resync()
+        if kb_driver.brightness != compositor.compose(clock()).brightness:
+            compositor.base.brightness = kb_driver.brightness
+        # Keyboard fades out while screen goes blank, whole curve is known upfront
+        if not system_sleeping:
+            _start_fade(kb_driver.brightness)
+    else:
+        _cancel_fade()
+        # dropping dim layer turns lights back on and restores brightness
+        compositor.remove(None, 'dim')
+        request_frame()
+        _schedule_sample(clock())
+
+
+def _start_fade(brightness):
+    global fade
+    if brightness is None:
+        return
+    fade = Fade(brightness, float(get_option(config, 'service', 'dim_delay', 10)), clock())
+    _schedule_fade_step()
+
+
+def on_sleep(sleeping):
+    """ Pauses every timer and stream that writes to keyboard before suspend, resumes with one diffed commit """
+    global system_sleeping, fade_interrupted, frame_source, flash_source
+    if sleeping == system_sleeping:
+        return
+    if sleeping:
+        metrics.inc('sleeps')
+        system_sleeping = True
+        _cancel_sample()
+        _stop_ambient()
+        fade_interrupted = fade is not None and not fade.done()
+        _cancel_fade()
+        _stop_audio()
+        if flash_source is not None:
+            gobject.source_remove(flash_source)
+            flash_source = None
+        compositor.remove(None, 'flash')
+        if frame_source is not None:
+            gobject.source_remove(frame_source)
+            frame_source = None
+        return
+
+    system_sleeping = False
+    # driver put back its own state on resume, diff is taken against what keyboard really shows
+    kb_driver.resync()
+    writes = kb_driver.writes
+    _commit_now()
+    metrics.inc('resume_writes', kb_driver.writes - writes)
+    if session_idle and fade_interrupted:
+        # fade goes on from where it stopped
+        _start_fade(compositor.compose(clock()).brightness)
+    fade_interrupted = False
+    if audio_enabled and 'audio' in power_modes and audio_stream is None:
+        _start_audio()
+    if ambient_light is not None:
+        _start_ambient()
+    scheduler.reset()
+    _schedule_sample(clock())
+
+
+def _schedule_fade_step():
+    global dim_source
+    deadline = fade.next_deadline()
+    if deadline is None:
+        return
+    dim_source = gobject.timeout_add(int(max(deadline - clock(), 0) * 1000), _fade_step)
+
+
+def _fade_step():
+    global dim_source
+    dim_source = None
+    compositor.submit(None, 'dim', dim_priority, fade.next_frame())
+    request_frame()
+    if not fade.done():
+        _schedule_fade_step()
+    return False
+
+
+def _cancel_fade():
+    global dim_source, fade
+    if dim_source is not None:
+        gobject.source_remove(dim_source)
+        dim_source = None
+    fade = None
 
 
 def update_stats():
-    # CPU
-    cpu_cfg = config.get('stats', 'cpu', '')
-    if cpu_cfg in ('left', 'center', 'right'):
-        kb_driver.set_colors({cpu_cfg: percent_to_kb_color(cpu.get_cpu_load(), thresholds)})
-
-    # Memory
-    memory_cfg = config.get('stats', 'memory', '')
-    if memory_cfg in ('left', 'center', 'right'):
-        kb_driver.set_colors({memory_cfg: percent_to_kb_color(memory.get_mem_usage(), thresholds)})
-
-    # GPU
-    gpu_cfg = config.get('stats', 'gpu', '')
-    if gpu_cfg in ('left', 'center', 'right'):
-        kb_driver.set_colors({gpu_cfg: percent_to_kb_color(gpu.get_gpu_load(), thresholds)})
+    """ Samples stats used by rules and returns whether all of them are steady """
+    samples = {}
+    if disk_stats is not None:
+        # disk and disk_throughput share one read, made once per sample
+        with metrics.timed('sampler_duration_seconds', source='diskstats'):
+            disk_stats.update()
+    for metric in plan.metrics:
+        with metrics.timed('sampler_duration_seconds', source=metric):
+            samples[metric] = samplers[metric]()
+
+    # Every rule contributes to the same frame, which becomes compositor stats layer
+    frame = plan.evaluate(samples, clock())
+
+    metrics.inc('samples')
+    metrics.set_counter('zone_writes_saved', sum(rule.filter.writes_saved() for rule in plan.rules))
+    compositor.submit(None, 'stats', stats_priority, frame)
+    request_frame()
+
+    # stall stats are steady as long as they stay on lowest color, a trigger reports anything else
+    return all(rule.filter.is_settled(settle_margin) if rule.polled else rule.filter.color == rule.filter.colors[0]
+               for rule in plan.rules)
+
+
+def commit_frame(frame):
+    global first_frame
+    metrics.inc('frames_computed')
+    # same frame is handed to every other device, none of them is waited for
+    for worker in backend_workers:
+        worker.submit(frame)
+    if kb_driver.commit(frame).is_empty():
+        metrics.inc('frames_skipped')
+    else:
+        metrics.inc('frames_committed')
+        if state_file:
+            save_state()
+    if first_frame:
+        first_frame = False
+        metrics.set_gauge('start_to_first_frame_seconds', time.time() - program_start)
+
+
+def _state_frame():
+    # Frame service itself owns: brightness set by user (not dimmed) and stats colors, client layers are left out
+    frame = compositor.base
+    layer = compositor.layers.get((None, 'stats'))
+    if layer is not None:
+        frame = frame.merge(layer.frame)
+    return frame
+
+
+def save_state():
+    """ Writes keyboard state to state file when it changed since it was last written """
+    global saved_state
+    frame = _state_frame()
+    lines = ["{} {}".format(section, frame.colors[section]) for section in sorted(frame.colors)]
+    if frame.brightness is not None:
+        lines.append("brightness {}".format(frame.brightness))
+    if frame.state_off is not None:
+        lines.append("off {}".format(int(frame.state_off)))
+    state = "\n".join(lines) + "\n"
+    if state == saved_state:
+        return
+    # written aside and renamed, a crash never leaves half a state behind
+    tmp = state_file + '.tmp'
+    try:
+        with open(tmp, 'w') as f:
+            f.write(state)
+        os.rename(tmp, state_file)
+        saved_state = state
+        metrics.inc('state_writes')
+    except (OSError, IOError):
+        print "Can't write keyboard state to {}!".format(state_file)
+
+
+def restore_state():
+    """ Commits keyboard state saved by last run as a single diffed frame """
+    global saved_state
+    if not state_file or not os.path.exists(state_file):
+        return
+    frame = TuxedoWmi.Frame()
+    try:
+        with open(state_file) as f:
+            saved_state = f.read()
+        for line in saved_state.splitlines():
+            key, value = line.split()
+            if key == 'brightness':
+                frame.brightness = min(max(int(value), 0), kb_driver.brightness_max)
+            elif key == 'off':
+                frame.state_off = bool(int(value))
+            elif value in TuxedoWmi.Keyboard.colors_code:
+                frame.set_color(key, value)
+    except (OSError, IOError, ValueError):
+        print "Can't read keyboard state from {}, ignoring it!".format(state_file)
+        return
+    compositor.base = compositor.base.merge(frame)
+    commit_frame(frame)
 
 
 if __name__ == "__main__":
@@ -0,0 +1,158 @@
+__author__ = 'ejcosta'
+
+import os
+import sys
+import time
+import wave
+import fcntl
+import subprocess
+import numpy
+
+# frequency edges (Hz) of bass, mid and treble bands
+BANDS = (20, 250, 4000, 16000)
+
+
+class AudioStream(object):
+    """ Signed 16 bit little endian samples from pulse (or pipewire) monitor, a wav file or stdin ('-') """
+
+    def __init__(self, source='pulse', rate=44100, device='@DEFAULT_MONITOR@'):
+        self.process = None
+        self.wav = None
+        self.rate = rate
+        self.channels = 1
+        # wav files are always readable, so they have to be read at their own pace instead of on poll
+        self.paced = False
+        if source == 'pulse':
+            self.process = subprocess.Popen(['parec', '--raw', '--format=s16le', '--channels=1',
+                                             '--rate={}'.format(rate), '--latency-msec=20',
+                                             '--device={}'.format(device)], stdout=subprocess.PIPE)
+            self.fd = self.process.stdout.fileno()
+        elif source == '-':
+            self.fd = sys.stdin.fileno()
+        else:
+            self.wav = wave.open(source, 'rb')
+            if self.wav.getsampwidth() != 2:
+                raise ValueError("{} is not a 16 bit wav file".format(source))
+            self.rate = self.wav.getframerate()
+            self.channels = self.wav.getnchannels()
+            self.paced = True
+            self.fd = None
+        if self.fd is not None:
+            fcntl.fcntl(self.fd, fcntl.F_SETFL, fcntl.fcntl(self.fd, fcntl.F_GETFL) | os.O_NONBLOCK)
+
+    def fileno(self):
+        return self.fd
+
+    def read(self, frames):
+        """ Returns up to frames samples (per channel) available now, empty at end of stream """
+        if self.wav is not None:
+            return self.wav.readframes(frames)
+        try:
+            return os.read(self.fd, frames * 2 * self.channels)
+        except OSError:
+            # nothing available yet
+            return None
+
+    def close(self):
+        if self.process is not None:
+            self.process.terminate()
+            self.process.wait()
+        if self.wav is not None:
+            self.wav.close()
+
+
+class AudioSpectrum(object):
+    """ Band energies of fixed size blocks, every block available is transformed in one vectorized pass """
+
+    def __init__(self, rate=44100, block=1024, channels=1, bands=BANDS, decay=0.999, max_blocks=64):
+        self.block = block
+        self.channels = channels
+        self.frame_size = block * channels * 2
+        self.decay = decay
+        self.pending = b''
+        self.window = numpy.hanning(block).astype(numpy.float32)
+        # work buffers are allocated once and sliced to the number of blocks at hand
+        self.samples = numpy.zeros((max_blocks, block), numpy.float32)
+        self.power = numpy.zeros((max_blocks, block // 2 + 1), numpy.float32)
+        frequencies = numpy.fft.rfftfreq(block, 1.0 / rate)
+        # at low rates upper bands lie past Nyquist frequency, they stay empty and read as silence
+        self.top = max(numpy.searchsorted(frequencies, bands[-1]), 1)
+        edges = numpy.minimum(numpy.searchsorted(frequencies, bands[:-1]), self.top)
+        self.empty = edges >= numpy.append(edges[1:], self.top)
+        self.edges = numpy.minimum(edges, self.top - 1)
+        # loudest energy seen per band, decaying so levels follow volume changes
+        self.peaks = numpy.full(len(bands) - 1, 1e-9)
+        self.levels = numpy.zeros(len(bands) - 1)
+        self.blocks = 0
+
+    def feed(self, data):
+        """ Adds samples and returns band levels (in percent of recent peak) of latest block, None if no block completed """
+        data = self.pending + data
+        count = min(len(data) // self.frame_size, len(self.samples))
+        if not count:
+            self.pending = data
+            return None
+        # only latest blocks matter for what keyboard shows, older backlog is dropped
+        skip = len(data) // self.frame_size - count
+        start = skip * self.frame_size
+        end = start + count * self.frame_size
+        self.pending = data[end:]
+
+        pcm = numpy.frombuffer(data[start:end], numpy.int16).reshape(count, self.block, self.channels)
+        samples = self.samples[:count]
+        if self.channels == 1:
+            samples[:] = pcm[:, :, 0]
+        else:
+            numpy.sum(pcm, axis=2, dtype=numpy.float32, out=samples)
+            samples /= self.channels
+        samples *= self.window
+        power = self.power[:count]
+        numpy.absolute(numpy.fft.rfft(samples, axis=1), out=power)
+        power *= power
+        energies = numpy.add.reduceat(power[:, :self.top], self.edges, axis=1)
+        energies[:, self.empty] = 0
+
+        for energy in energies:
+            numpy.maximum(energy, self.peaks * self.decay, out=self.peaks)
+        numpy.multiply(energies[-1] / self.peaks, 100, out=self.levels)
+        self.blocks += count
+        return self.levels
+
+
+def print_audio_levels(blocks=50):
+    stream = AudioStream()
+    spectrum = AudioSpectrum(stream.rate)
+    try:
+        while spectrum.blocks < blocks:
+            data = stream.read(spectrum.block)
+            if data is None:
+                time.sleep(0.01)
+                continue
+            levels = spectrum.feed(data)
+            if levels is not None:
+                print("Bass: {:5.1f} Mid: {:5.1f} Treble: {:5.1f}".format(*levels))
+    finally:
+        stream.close()
+
+
+def benchmark(seconds=60, rate=44100, block=1024, chunk=4096):
+    """ CPU time spent on analysis per second of audio, fed in chunks the size pulse hands out """
+    t = numpy.arange(seconds * rate) / float(rate)
+    signal = (numpy.sin(2 * numpy.pi * 60 * t) + numpy.sin(2 * numpy.pi * 1000 * t) * 0.5 +
+              numpy.random.uniform(-0.2, 0.2, len(t))) * 10000
+    data = signal.astype(numpy.int16).tobytes()
+    spectrum = AudioSpectrum(rate, block)
+    clock = getattr(time, 'process_time', None) or time.clock
+    start = clock()
+    for offset in range(0, len(data), chunk * 2):
+        spectrum.feed(data[offset:offset + chunk * 2])
+    cpu = clock() - start
+    print("Analyzed {} blocks of {} samples, {:.3f}ms CPU per second of audio".format(
+        spectrum.blocks, block, cpu / seconds * 1000))
+
+
+if __name__ == "__main__":
+    if sys.argv[1:] == ['bench']:
+        benchmark()
+    else:
+        print_audio_levels()
@@ -0,0 +1,42 @@
+__author__ = 'ejcosta'
+
+import os
+import fnmatch
+from scheduler import clock
+
+
+class ProcCounters(object):
+    """ Per device counters file (e.g. /proc/diskstats) kept open and reread on each sample """
+
+    def __init__(self, location, devices):
+        self.patterns = devices.split()
+        self.fd = os.open(location, os.O_RDONLY)
+        self.wanted = {}
+
+    def close(self):
+        os.close(self.fd)
+
+    def is_wanted(self, name):
+        # device names are matched once, later samples only look them up
+        wanted = self.wanted.get(name)
+        if wanted is None:
+            wanted = self.wanted[name] = any(fnmatch.fnmatchcase(name, pattern) for pattern in self.patterns)
+        return wanted
+
+    def read(self):
+        os.lseek(self.fd, 0, os.SEEK_SET)
+        chunks = []
+        while True:
+            chunk = os.read(self.fd, 65536)
+            if not chunk:
+                return b''.join(chunks).decode('ascii')
+            chunks.append(chunk)
+
+
+def increase(current, last):
+    """ Counters increase since last sample, summed over devices present in both samples
+
+    A device showing up (hot plug) only counts from its second sample, instead of adding
+    everything it counted so far as a burst.
+    """
+    return sum(max(value - last[name], 0) for name, value in current.items() if name in last)
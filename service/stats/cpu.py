@@ -2,13 +2,17 @@ __author__ = 'ejcosta'
 
 import psutil
 
+# first call has nothing to measure against and returns 0.0, service's first sample gets a real value
+psutil.cpu_percent(interval=None)
 
-def get_cpu_load():
-    return psutil.cpu_percent(interval=1)
+
+def get_cpu_load(interval=None):
+    # without interval load is measured since previous call, so sampling doesn't block
+    return psutil.cpu_percent(interval=interval)
 
 
 def print_cpu_load():
-    print("CPU Percent: {}".format(get_cpu_load()))
+    print("CPU Percent: {}".format(get_cpu_load(1)))
 
 if __name__ == "__main__":
     print_cpu_load()
\ No newline at end of file
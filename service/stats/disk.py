@@ -0,0 +1,69 @@
+__author__ = 'ejcosta'
+
+import time
+from counters import ProcCounters, increase, clock
+
+DISKSTATS_LOCATION = '/proc/diskstats'
+# whole disks only, partitions, loop, ram and device mapper devices are left out
+DEFAULT_DEVICES = 'sd? nvme?n? mmcblk? vd? hd?'
+SECTOR_SIZE = 512
+
+
+class DiskStats(ProcCounters):
+    """ Busy time and throughput of disks since previous sample, from one /proc/diskstats read kept open """
+
+    def __init__(self, devices=DEFAULT_DEVICES, max_throughput=500, location=DISKSTATS_LOCATION):
+        ProcCounters.__init__(self, location, devices)
+        # MB/s shown as 100%
+        self.max_throughput = float(max_throughput) * 1024 * 1024
+        self.last = None
+        self.utilization = 0.0
+        self.throughput = 0.0
+
+    def update(self):
+        """ Reads counters once per sample, both metrics below come from this read """
+        now = clock()
+        ticks = {}
+        sectors = {}
+        for line in self.read().splitlines():
+            # major minor name, rest of line is only split for wanted devices
+            fields = line.split(None, 3)
+            if len(fields) < 4 or not self.is_wanted(fields[2]):
+                continue
+            counters = fields[3].split()
+            # sectors read, sectors written and milliseconds spent doing I/O
+            sectors[fields[2]] = int(counters[2]) + int(counters[6])
+            ticks[fields[2]] = int(counters[9])
+
+        if self.last is not None:
+            since, last_ticks, last_sectors = self.last
+            elapsed = now - since
+            if elapsed > 0:
+                self.throughput = increase(sectors, last_sectors) * SECTOR_SIZE / elapsed
+                # busiest disk, like %util of iostat
+                self.utilization = max([(count - last_ticks.get(name, count)) / (elapsed * 10)
+                                        for name, count in ticks.items()] or [0])
+        self.last = (now, ticks, sectors)
+
+    def get_utilization(self):
+        """ Share of time (in percent) busiest disk spent doing I/O between last two updates """
+        return min(self.utilization, 100.0)
+
+    def get_throughput(self):
+        """ Bytes read and written between last two updates, in percent of max_throughput """
+        return min(self.throughput / self.max_throughput * 100, 100.0)
+
+
+def print_disk_stats():
+    disk = DiskStats()
+    disk.update()
+    time.sleep(1)
+    disk.update()
+    print("Disk Percent: {:.1f}".format(disk.get_utilization()))
+    print("Disk Throughput: {:.2f}MB/s".format(disk.throughput / 1024 / 1024))
+    disk.close()
+
+
+if __name__ == "__main__":
+    # python -m stats.disk, from service directory
+    print_disk_stats()
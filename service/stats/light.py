@@ -0,0 +1,170 @@
+__author__ = 'ejcosta'
+
+import os
+import re
+import sys
+import glob
+import math
+import struct
+
+IIO_LOCATION = 'sys/bus/iio/devices'
+# scan element type, e.g. le:u16/32>>0
+_scan_type = re.compile(r'(be|le):(s|u)(\d+)/(\d+)>>(\d+)')
+
+
+def _read(path):
+    try:
+        with open(path) as f:
+            return f.read().strip()
+    except (OSError, IOError):
+        return None
+
+
+def _write(path, value):
+    with open(path, 'w') as f:
+        f.write('{}\n'.format(value))
+
+
+def lux_to_percent(lux, dark, bright):
+    """ Position of lux between dark and bright on a log scale, eyes perceive light that way """
+    if lux <= dark:
+        return 0.0
+    if lux >= bright:
+        return 100.0
+    return 100 * math.log(float(lux) / dark) / math.log(float(bright) / dark)
+
+
+def brightness_levels(min_brightness, max_brightness):
+    """ Levels from brightest (dark room) to dimmest and percent thresholds between them """
+    levels = tuple(range(max_brightness, min_brightness - 1, -1))
+    steps = max(len(levels) - 1, 1)
+    return [(i + 0.5) * 100.0 / steps for i in range(len(levels) - 1)], levels
+
+
+class AmbientLight(object):
+    """ IIO illuminance sensor, read from its buffer chardev when it has a trigger or polled otherwise """
+
+    def __init__(self, root='/', device=None, buffered=True):
+        self.root = root
+        self.path = None
+        for path in sorted(glob.glob(os.path.join(root, IIO_LOCATION, 'iio:device*'))):
+            if device is not None and _read(os.path.join(path, 'name')) != device:
+                continue
+            if os.path.exists(os.path.join(path, 'in_illuminance_raw')) or \
+                    os.path.exists(os.path.join(path, 'in_illuminance_input')):
+                self.path = path
+                break
+        if self.path is None:
+            raise IOError("No ambient light sensor found")
+        self.name = _read(os.path.join(self.path, 'name'))
+
+        # buffer always carries raw samples, processed attribute (already in lux) is only used when polling
+        self.scale = float(_read(os.path.join(self.path, 'in_illuminance_scale')) or 1)
+        self.offset = float(_read(os.path.join(self.path, 'in_illuminance_offset')) or 0)
+        self.processed = os.path.exists(os.path.join(self.path, 'in_illuminance_input'))
+        attribute = 'in_illuminance_input' if self.processed else 'in_illuminance_raw'
+        self.fd = os.open(os.path.join(self.path, attribute), os.O_RDONLY)
+
+        self.buffer_fd = None
+        self.pending = b''
+        # trigger and scan elements found on device, put back once buffer is closed
+        self.saved = []
+        if buffered:
+            try:
+                self._enable_buffer()
+            except (OSError, IOError, ValueError):
+                self.close_buffer()
+
+    def _enable_buffer(self):
+        scan = os.path.join(self.path, 'scan_elements')
+        if not os.path.exists(os.path.join(scan, 'in_illuminance_en')):
+            return
+        # device is shared (e.g. iio-sensor-proxy), a buffer somebody else runs is left alone
+        if _read(os.path.join(self.path, 'buffer', 'enable')) == '1':
+            return
+        current_trigger = os.path.join(self.path, 'trigger', 'current_trigger')
+        if not _read(current_trigger):
+            # sensors usually come with their own trigger, named after them (e.g. als-dev0)
+            triggers = [_read(os.path.join(trigger, 'name'))
+                        for trigger in sorted(glob.glob(os.path.join(self.root, IIO_LOCATION, 'trigger*')))]
+            triggers = [t for t in triggers if t and self.name and t.startswith(self.name)]
+            if not triggers:
+                return
+            self.saved.append((current_trigger, ''))
+            _write(current_trigger, triggers[0])
+
+        # illuminance is the only channel captured, every sample in buffer is one reading
+        for element in glob.glob(os.path.join(scan, '*_en')):
+            self.saved.append((element, _read(element)))
+            _write(element, 1 if element.endswith('in_illuminance_en') else 0)
+        match = _scan_type.match(_read(os.path.join(scan, 'in_illuminance_type')) or '')
+        if not match:
+            raise ValueError("Unknown illuminance scan type")
+        endian, sign, bits, storage, shift = match.groups()
+        self.sample = struct.Struct('{}{}'.format('<' if endian == 'le' else '>',
+                                                  {8: 'B', 16: 'H', 32: 'I', 64: 'Q'}[int(storage)]))
+        self.bits, self.shift, self.signed = int(bits), int(shift), sign == 's'
+
+        _write(os.path.join(self.path, 'buffer', 'enable'), 1)
+        self.buffer_fd = os.open(os.path.join(self.root, 'dev', os.path.basename(self.path)),
+                                 os.O_RDONLY | os.O_NONBLOCK)
+
+    def close_buffer(self):
+        if self.buffer_fd is not None:
+            os.close(self.buffer_fd)
+            self.buffer_fd = None
+        if not self.saved:
+            return
+        # scan elements first, trigger last, in reverse of the order they were changed
+        for path, value in [(os.path.join(self.path, 'buffer', 'enable'), 0)] + self.saved[::-1]:
+            try:
+                _write(path, value)
+            except (OSError, IOError):
+                print("Can't restore {}".format(path))
+        self.saved = []
+
+    def close(self):
+        self.close_buffer()
+        os.close(self.fd)
+
+    def fileno(self):
+        return self.buffer_fd
+
+    def _lux(self, raw):
+        return (raw + self.offset) * self.scale
+
+    def read(self):
+        """ Illuminance in lux, read from sensor attribute (busy while buffer is enabled) """
+        os.lseek(self.fd, 0, os.SEEK_SET)
+        value = float(os.read(self.fd, 32))
+        return value if self.processed else self._lux(value)
+
+    def read_buffer(self):
+        """ Latest illuminance (in lux) buffered since last call, None if no complete sample arrived """
+        try:
+            data = self.pending + os.read(self.buffer_fd, 4096)
+        except OSError:
+            return None
+        size = self.sample.size
+        count = len(data) // size
+        self.pending = data[count * size:]
+        if not count:
+            return None
+        # readings in between are older than what keyboard should follow
+        value = self.sample.unpack_from(data, (count - 1) * size)[0] >> self.shift
+        value &= (1 << self.bits) - 1
+        if self.signed and value & (1 << (self.bits - 1)):
+            value -= 1 << self.bits
+        return self._lux(value)
+
+
+def print_ambient_light(root='/'):
+    sensor = AmbientLight(root, buffered=False)
+    print("Sensor: {} ({})".format(sensor.name, sensor.path))
+    print("Illuminance: {:.1f} lux".format(sensor.read()))
+    sensor.close()
+
+
+if __name__ == "__main__":
+    # light.py [root], root of a (fake) tree holding sys/bus/iio/devices
+    print_ambient_light(*sys.argv[1:2])
@@ -0,0 +1,57 @@
+__author__ = 'ejcosta'
+
+import time
+from counters import ProcCounters, increase, clock
+
+NET_DEV_LOCATION = '/proc/net/dev'
+# wired, wireless and mobile broadband interfaces, loopback, bridges and tunnels are left out
+DEFAULT_DEVICES = 'en* eth* wl* ww* usb*'
+
+
+class NetworkStats(ProcCounters):
+    """ Throughput of network interfaces since previous sample, from /proc/net/dev kept open """
+
+    def __init__(self, devices=DEFAULT_DEVICES, max_throughput=100, location=NET_DEV_LOCATION):
+        ProcCounters.__init__(self, location, devices)
+        # Mbit/s shown as 100%
+        self.max_throughput = float(max_throughput) * 1000 * 1000 / 8
+        self.last = None
+        self.throughput = 0.0
+
+    def update(self):
+        now = clock()
+        totals = {}
+        # two header lines, then "name: 8 receive counters 8 transmit counters"
+        for line in self.read().splitlines()[2:]:
+            name, _, counters = line.partition(':')
+            name = name.strip()
+            if not self.is_wanted(name):
+                continue
+            counters = counters.split()
+            # bytes received and transmitted
+            totals[name] = int(counters[0]) + int(counters[8])
+
+        if self.last is not None:
+            since, last_totals = self.last
+            if now > since:
+                self.throughput = increase(totals, last_totals) / (now - since)
+        self.last = (now, totals)
+
+    def get_throughput(self):
+        """ Bytes received and sent since previous sample, in percent of max_throughput """
+        self.update()
+        return min(self.throughput / self.max_throughput * 100, 100.0)
+
+
+def print_network_stats():
+    network = NetworkStats()
+    network.update()
+    time.sleep(1)
+    print("Network Percent: {:.1f}".format(network.get_throughput()))
+    print("Network Throughput: {:.3f}Mbit/s".format(network.throughput * 8 / 1000 / 1000))
+    network.close()
+
+
+if __name__ == "__main__":
+    # python -m stats.network, from service directory
+    print_network_stats()
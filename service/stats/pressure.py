@@ -0,0 +1,45 @@
+__author__ = 'ejcosta'
+
+import os
+
+PRESSURE_LOCATION = '/proc/pressure/'
+
+
+class PressureMonitor(object):
+    """ Registers pressure stall triggers, their fds report POLLPRI when one of them fires """
+
+    def __init__(self, resources, stall_ms=200, window_ms=2000, location=PRESSURE_LOCATION):
+        self.fds = {}
+        try:
+            for resource in resources:
+                fd = os.open(location + resource, os.O_RDWR | os.O_NONBLOCK)
+                self.fds[resource] = fd
+                # trigger fires when some task stalled for stall_ms within window_ms
+                os.write(fd, 'some {} {}\0'.format(int(stall_ms) * 1000, int(window_ms) * 1000).encode('ascii'))
+        except (OSError, IOError):
+            self.close()
+            raise
+
+    def close(self):
+        for fd in self.fds.values():
+            os.close(fd)
+        self.fds.clear()
+
+    def get_pressure(self, resource):
+        """ Share of time (in percent) some task stalled on resource over the last 10 seconds """
+        fd = self.fds[resource]
+        os.lseek(fd, 0, os.SEEK_SET)
+        # some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+        some = os.read(fd, 256).decode('ascii').splitlines()[0]
+        return float(some.split()[1].split('=')[1])
+
+
+def print_pressure():
+    monitor = PressureMonitor(['cpu', 'memory', 'io'])
+    for resource in sorted(monitor.fds):
+        print("{} Pressure: {}".format(resource.upper(), monitor.get_pressure(resource)))
+    monitor.close()
+
+
+if __name__ == "__main__":
+    print_pressure()
@@ -0,0 +1,147 @@
+__author__ = 'ejcosta'
+
+import os
+import sys
+import glob
+
+# hwmon chips and labels of CPU package temperature, in order of preference
+PACKAGE_SENSORS = (
+    ('coretemp', 'Package id'),
+    ('k10temp', 'Tctl'),
+    ('k10temp', 'Tdie'),
+    ('zenpower', 'Tdie'),
+)
+# thermal zones used when no hwmon chip above is found
+PACKAGE_ZONES = ('x86_pkg_temp', 'acpitz')
+
+
+def _read(path):
+    try:
+        with open(path) as f:
+            return f.read().strip()
+    except (OSError, IOError):
+        return None
+
+
+def _read_int(path):
+    try:
+        return int(_read(path))
+    except (TypeError, ValueError):
+        return None
+
+
+class ThermalMonitor(object):
+    """ CPU package temperature and fan speed, from sensors found once and kept open """
+
+    def __init__(self, root='/', sensor=None, max_temp=100, max_fan=5000):
+        self.hwmon_location = os.path.join(root, 'sys/class/hwmon')
+        self.thermal_location = os.path.join(root, 'sys/class/thermal')
+        self.temp_fd = None
+        self.fan_fds = []
+        # alarm attributes notify pollers when they change (POLLPRI), readings only need a look then
+        self.alarm_fds = []
+        self.max_temp = float(max_temp)
+        self.max_fan = float(max_fan)
+        self.sensor = None
+        try:
+            self._find_temperature(sensor)
+            self._find_fans()
+        except (OSError, IOError):
+            self.close()
+            raise
+
+    def _open(self, path):
+        return os.open(path, os.O_RDONLY)
+
+    def _open_alarm(self, path):
+        if os.path.exists(path):
+            fd = self._open(path)
+            # sysfs only notifies after attribute was read once
+            self.read_alarm(fd)
+            self.alarm_fds.append(fd)
+
+    def _find_temperature(self, sensor):
+        chips = {}
+        for chip in sorted(glob.glob(os.path.join(self.hwmon_location, 'hwmon*'))):
+            chips.setdefault(_read(os.path.join(chip, 'name')), []).append(chip)
+
+        candidates = PACKAGE_SENSORS if sensor is None else ((sensor, None),)
+        for name, label in candidates:
+            for chip in chips.get(name, []):
+                for temp in sorted(glob.glob(os.path.join(chip, 'temp*_input'))):
+                    prefix = temp[:-len('_input')]
+                    if label is None or (_read(prefix + '_label') or '').startswith(label):
+                        self.sensor = '{} {}'.format(name, os.path.basename(prefix))
+                        self.temp_fd = self._open(temp)
+                        crit = _read_int(prefix + '_crit')
+                        if crit:
+                            self.max_temp = crit / 1000.0
+                        self._open_alarm(prefix + '_crit_alarm')
+                        self._open_alarm(prefix + '_max_alarm')
+                        return
+
+        zone_types = PACKAGE_ZONES if sensor is None else (sensor,)
+        zones = sorted(glob.glob(os.path.join(self.thermal_location, 'thermal_zone*')))
+        for zone_type in zone_types:
+            for zone in zones:
+                if _read(os.path.join(zone, 'type')) != zone_type:
+                    continue
+                self.sensor = '{} {}'.format(zone_type, os.path.basename(zone))
+                self.temp_fd = self._open(os.path.join(zone, 'temp'))
+                for trip in glob.glob(os.path.join(zone, 'trip_point_*_type')):
+                    if _read(trip) == 'critical':
+                        crit = _read_int(trip[:-len('_type')] + '_temp')
+                        if crit:
+                            self.max_temp = crit / 1000.0
+                return
+
+        raise IOError("No CPU temperature sensor found")
+
+    def _find_fans(self):
+        for fan in sorted(glob.glob(os.path.join(self.hwmon_location, 'hwmon*', 'fan*_input'))):
+            prefix = fan[:-len('_input')]
+            fan_max = _read_int(prefix + '_max')
+            self.fan_fds.append((self._open(fan), float(fan_max) if fan_max else self.max_fan))
+            self._open_alarm(prefix + '_alarm')
+
+    def close(self):
+        for fd in [self.temp_fd] + [fd for fd, _ in self.fan_fds] + self.alarm_fds:
+            if fd is not None:
+                os.close(fd)
+        self.temp_fd = None
+        self.fan_fds = []
+        self.alarm_fds = []
+
+    @staticmethod
+    def read_value(fd):
+        os.lseek(fd, 0, os.SEEK_SET)
+        return int(os.read(fd, 32))
+
+    def read_alarm(self, fd):
+        """ Returns whether alarm is raised, reading it also rearms its notification """
+        return self.read_value(fd) != 0
+
+    def get_temperature(self):
+        """ CPU package temperature in percent of its critical temperature """
+        return min(self.read_value(self.temp_fd) / 10.0 / self.max_temp, 100.0)
+
+    def get_celsius(self):
+        return self.read_value(self.temp_fd) / 1000.0
+
+    def get_fan(self):
+        """ Speed of fastest fan in percent of its maximum, 0 without fans """
+        return min(max([self.read_value(fd) / fan_max * 100 for fd, fan_max in self.fan_fds] or [0]), 100.0)
+
+
+def print_thermal(root='/'):
+    monitor = ThermalMonitor(root)
+    print("Sensor: {} ({} alarms)".format(monitor.sensor, len(monitor.alarm_fds)))
+    print("Temperature: {}C ({:.1f}% of {}C)".format(monitor.get_celsius(), monitor.get_temperature(),
+                                                    monitor.max_temp))
+    print("Fan Percent: {:.1f} ({} fans)".format(monitor.get_fan(), len(monitor.fan_fds)))
+    monitor.close()
+
+
+if __name__ == "__main__":
+    # thermal.py [root], root of a (fake) tree holding sys/class/hwmon and sys/class/thermal
+    print_thermal(*sys.argv[1:2])
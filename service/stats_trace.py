@@ -0,0 +1,296 @@
+__author__ = 'ejcosta'
+
+import os
+import time
+import heapq
+import struct
+import shutil
+import argparse
+import tempfile
+import ConfigParser
+from StringIO import StringIO
+import metrics
+import scheduler
+import service_handler
+from scheduler import clock
+
+MAGIC = b'KBTRACE1'
+# milliseconds since trace start, channel index and value, 9 bytes per event
+RECORD = struct.Struct('<IBf')
+channels = ('cpu', 'memory', 'gpu', 'cpu_pressure', 'memory_pressure', 'io_pressure', 'idle', 'temperature', 'fan',
+            'disk', 'disk_throughput', 'network')
+
+# parameters of a keyboard with lights on, full brightness and blue zones
+default_parameters = {
+    'kb_brightness': '10',
+    'kb_off': '0',
+    'kb_left': '1',
+    'kb_center': '1',
+    'kb_right': '1',
+}
+
+
+class TraceWriter(object):
+
+    def __init__(self, path):
+        self.file = open(path, 'wb')
+        self.file.write(MAGIC)
+        self.start = clock()
+        self.events = 0
+
+    def record(self, channel, value):
+        self.file.write(RECORD.pack(int((clock() - self.start) * 1000), channels.index(channel), float(value)))
+        self.events += 1
+
+    def close(self):
+        self.file.close()
+
+
+def read_trace(path):
+    """ Returns (seconds, channel, value) events of a trace file in recorded order """
+    with open(path, 'rb') as f:
+        if f.read(len(MAGIC)) != MAGIC:
+            raise ValueError("{} is not a stats trace".format(path))
+        data = f.read()
+    events = []
+    for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        ms, channel, value = RECORD.unpack_from(data, offset)
+        events.append((ms / 1000.0, channels[channel], value))
+    return events
+
+
+def record(path, interval, duration=None):
+    """ Samples every stat available on this machine and session idle changes into a trace file """
+    import gobject
+    from dbus.mainloop.glib import DBusGMainLoop
+    DBusGMainLoop(set_as_default=True)
+    import dbus_handler
+    from stats import (
+        cpu,
+        memory,
+        gpu,
+        pressure,
+        thermal,
+        disk,
+        network,
+    )
+
+    disk_stats = disk.DiskStats()
+    network_stats = network.NetworkStats()
+    samplers = {
+        'cpu': cpu.get_cpu_load,
+        'memory': memory.get_mem_usage,
+        'gpu': gpu.get_gpu_load,
+        'disk': disk_stats.get_utilization,
+        'disk_throughput': disk_stats.get_throughput,
+        'network': network_stats.get_throughput,
+    }
+    monitor = None
+    try:
+        monitor = pressure.PressureMonitor(['cpu', 'memory', 'io'])
+        for resource in monitor.fds:
+            samplers[resource + '_pressure'] = lambda resource=resource: monitor.get_pressure(resource)
+    except (OSError, IOError):
+        print "Pressure stall information unavailable, leaving it out of trace!"
+    sensors = None
+    try:
+        sensors = thermal.ThermalMonitor()
+        samplers['temperature'] = sensors.get_temperature
+        samplers['fan'] = sensors.get_fan
+    except (OSError, IOError):
+        print "No temperature sensor found, leaving it out of trace!"
+
+    writer = TraceWriter(path)
+
+    def sample():
+        disk_stats.update()
+        for channel in sorted(samplers):
+            try:
+                writer.record(channel, samplers[channel]())
+            except Exception:
+                print "Can't sample {}, leaving it out of trace!".format(channel)
+                del samplers[channel]
+        return True
+
+    loop = gobject.MainLoop()
+    dbus_handler.register_signal_watch(lambda idle: writer.record('idle', idle))
+    writer.record('idle', dbus_handler._get_idle_hint())
+    sample()
+    gobject.timeout_add(int(interval * 1000), sample)
+    if duration:
+        gobject.timeout_add(int(duration * 1000), loop.quit)
+    try:
+        loop.run()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        dbus_handler.unregister_signal_watch()
+        writer.close()
+        if monitor is not None:
+            monitor.close()
+        if sensors is not None:
+            sensors.close()
+        disk_stats.close()
+        network_stats.close()
+    print "Recorded {} events in {:.1f}s".format(writer.events, clock() - writer.start)
+
+
+class SimulatedLoop(object):
+    """ Stands in for gobject timers, virtual clock runs speed times faster than wall clock (0 for no limit) """
+
+    def __init__(self, speed):
+        self.speed = float(speed)
+        self.now = 0.0
+        self.timers = []
+        self.removed = set()
+        self.next_source = 1
+        self.wall_start = time.time()
+
+    def clock(self):
+        return self.now
+
+    def timeout_add(self, interval, callback, *args):
+        return self.add(self.now + interval / 1000.0, interval / 1000.0, callback, *args)
+
+    def timeout_add_seconds(self, interval, callback, *args):
+        return self.add(self.now + interval, interval, callback, *args)
+
+    def source_remove(self, source):
+        self.removed.add(source)
+
+    def add(self, deadline, interval, callback, *args):
+        source = self.next_source
+        self.next_source += 1
+        heapq.heappush(self.timers, (deadline, source, interval, callback, args))
+        return source
+
+    def run(self, until):
+        while self.timers and self.timers[0][0] <= until:
+            deadline, source, interval, callback, args = heapq.heappop(self.timers)
+            if source in self.removed:
+                self.removed.discard(source)
+                continue
+            if self.speed:
+                time.sleep(max(deadline / self.speed - (time.time() - self.wall_start), 0))
+            self.now = deadline
+            # like gobject, callbacks returning True run again after the same interval
+            if callback(*args):
+                heapq.heappush(self.timers, (deadline + interval, source, interval, callback, args))
+        self.now = until
+
+
+def make_parameter_dir(source=None):
+    """ Copies keyboard parameters (or defaults) into a directory that stands in for the driver """
+    location = tempfile.mkdtemp(prefix='kb_params.')
+    for parameter, value in default_parameters.items():
+        if source is not None:
+            with open(os.path.join(source, parameter)) as f:
+                value = f.read().strip()
+        with open(os.path.join(location, parameter), 'w') as f:
+            f.write(value + '\n')
+    return location + '/'
+
+
+def replay(path, config_file, speed=1000, parameters=None, tail=None):
+    """ Runs service handler over a recorded trace on a simulated clock and reports what it did """
+    events = read_trace(path)
+    if not events:
+        print "Trace {} holds no events".format(path)
+        return
+
+    # Service config with keyboard pointed at stand-in parameters
+    config = ConfigParser.ConfigParser()
+    config.readfp(config_file)
+    location = make_parameter_dir(parameters)
+    if not config.has_section('driver'):
+        config.add_section('driver')
+    config.set('driver', 'location', location)
+    config_text = StringIO()
+    config.write(config_text)
+    config_text.seek(0)
+
+    sim = SimulatedLoop(speed)
+    service_handler.gobject = sim
+    service_handler.clock = sim.clock
+    scheduler.clock = sim.clock
+    try:
+        service_handler.initial_program_setup(config_text)
+        service_handler.state_file = None
+        # Triggers can't be replayed, so every rule is kept and pressure stats are polled from trace
+        if service_handler.pressure_monitor is not None:
+            service_handler.pressure_monitor.close()
+            service_handler.pressure_monitor = None
+        service_handler.plan = service_handler.rules.compile_rules(service_handler.config, service_handler._make_filter)
+        values = {}
+        service_handler.samplers = dict((channel, lambda channel=channel: values.get(channel, 0.0))
+                                        for channel in channels)
+
+        # Idle changes reach service at recorded time, latency is measured up to first hardware write
+        pending_idle = []
+        reactions = []
+        commit_frame = service_handler.commit_frame
+
+        def feed(channel, value):
+            values[channel] = value
+            if channel == 'idle' and bool(value) != service_handler.session_idle:
+                pending_idle.append(sim.now)
+                service_handler.on_idle_changed(bool(value))
+            return False
+
+        def timed_commit_frame(frame):
+            writes = service_handler.kb_driver.writes
+            commit_frame(frame)
+            if pending_idle and service_handler.kb_driver.writes != writes:
+                reactions.extend(sim.now - start for start in pending_idle)
+                del pending_idle[:]
+
+        service_handler.commit_frame = timed_commit_frame
+        for seconds, channel, value in events:
+            sim.add(seconds, 0, feed, channel, value)
+
+        service_handler.init_program_state()
+        service_handler._schedule_sample(sim.clock())
+        if tail is None:
+            tail = service_handler.max_polling_interval
+        sim.run(events[-1][0] + tail)
+        wall = time.time() - sim.wall_start
+        kb_driver = service_handler.kb_driver
+        kb_driver.close()
+    finally:
+        shutil.rmtree(location, ignore_errors=True)
+
+    print "Replayed {:.1f}s of trace ({} events) in {:.2f}s".format(sim.now, len(events), wall)
+    print "Hardware writes: {} (reads: {})".format(kb_driver.writes, kb_driver.reads)
+    print "Frames committed: {} of {} computed ({} skipped)".format(metrics.get('frames_committed'),
+                                                                    metrics.get('frames_computed'),
+                                                                    metrics.get('frames_skipped'))
+    print "Samples: {}".format(metrics.get('samples'))
+    for callback in ('sample', 'frame'):
+        total, count, longest = metrics.summary('loop_iteration_seconds', callback=callback)
+        if count:
+            print "Decision latency ({}): {:.3f}ms avg, {:.3f}ms max over {}".format(
+                callback, total / count * 1000, longest * 1000, count)
+    if reactions:
+        print "Idle reaction latency: {:.3f}s avg, {:.3f}s max over {}".format(
+            sum(reactions) / len(reactions), max(reactions), len(reactions))
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Record stats traces and replay them through the service")
+    commands = parser.add_subparsers(dest='command')
+    record_parser = commands.add_parser('record', help="record stats and idle changes of this machine")
+    record_parser.add_argument('trace')
+    record_parser.add_argument('-i', '--interval', type=float, default=1, help="seconds between samples")
+    record_parser.add_argument('-d', '--duration', type=float, help="seconds to record, until Ctrl+C if unset")
+    replay_parser = commands.add_parser('replay', help="replay a trace against stand-in keyboard parameters")
+    replay_parser.add_argument('trace')
+    replay_parser.add_argument('-c', '--config', default='kb_light_stats.conf', type=argparse.FileType('r'))
+    replay_parser.add_argument('-s', '--speed', type=float, default=1000,
+                               help="times faster than recorded, 0 runs as fast as possible")
+    replay_parser.add_argument('-p', '--parameters', help="directory to copy initial keyboard parameters from")
+    args = parser.parse_args()
+
+    if args.command == 'record':
+        record(args.trace, args.interval, args.duration)
+    else:
+        replay(args.trace, args.config, args.speed, args.parameters)
@@ -0,0 +1,34 @@
+__author__ = 'ejcosta'
+
+import os
+import sys
+import unittest
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+
+from TuxedoWmi.utils import Fade
+
+
+class FadeTest(unittest.TestCase):
+
+    def frames(self, start):
+        fade = Fade(start, 10, 0)
+        frames = []
+        while not fade.done():
+            frames.append(fade.next_frame())
+        return frames
+
+    def test_last_frame_turns_lights_off(self):
+        frames = self.frames(5)
+        self.assertEqual([frame.brightness for frame in frames], [4, 3, 2, 1, 0])
+        self.assertTrue(frames[-1].state_off)
+        self.assertTrue(all(frame.state_off is None for frame in frames[:-1]))
+
+    def test_dark_keyboard_is_turned_off(self):
+        frames = self.frames(0)
+        self.assertEqual(len(frames), 1)
+        self.assertTrue(frames[0].state_off)
+
+
+if __name__ == "__main__":
+    unittest.main()